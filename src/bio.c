@@ -23,6 +23,132 @@ LUA_FUNCTION(openssl_bio_new_file) {
 	return 1;
 }
 
+/*  openssl.bio_filter_md(evp_digest md|string alg) => bio{{{1
+*/
+LUA_FUNCTION(openssl_bio_filter_md) {
+	const EVP_MD* md = NULL;
+	BIO *bio;
+	md = GET_DIGEST(1);
+	if (!md)
+		luaL_error(L, "#1 unknown digest method");
+	bio = BIO_new(BIO_f_md());
+	BIO_set_md(bio, md);
+	PUSH_OBJECT(bio,"openssl.bio");
+	return 1;
+}
+/* }}} */
+
+/*  openssl.bio_filter_cipher(evp_cipher cipher|string alg, string key, string iv, boolean enc) => bio{{{1
+*/
+LUA_FUNCTION(openssl_bio_filter_cipher) {
+	const EVP_CIPHER* cipher = NULL;
+	size_t key_len, iv_len;
+	const char* key = luaL_checklstring(L,2,&key_len);
+	const char* iv = luaL_optlstring(L,3,NULL,&iv_len);
+	int enc = auxiliar_checkboolean(L,4);
+	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+	BIO *bio;
+
+	cipher = GET_CIPHER(1);
+	if (!cipher)
+		luaL_error(L, "#1 unknown cipher method");
+
+	memcpy(evp_key, key, key_len<EVP_MAX_KEY_LENGTH ? key_len : EVP_MAX_KEY_LENGTH);
+	if (iv)
+		memcpy(evp_iv, iv, iv_len<EVP_MAX_IV_LENGTH ? iv_len : EVP_MAX_IV_LENGTH);
+
+	bio = BIO_new(BIO_f_cipher());
+	BIO_set_cipher(bio, cipher, evp_key, evp_iv, enc);
+	PUSH_OBJECT(bio,"openssl.bio");
+	return 1;
+}
+/* }}} */
+
+/*  openssl.bio_filter_base64([boolean newline=true]) => bio{{{1
+*/
+LUA_FUNCTION(openssl_bio_filter_base64) {
+	int nl = lua_isnoneornil(L,1) ? 1 : lua_toboolean(L,1);
+	BIO *bio = BIO_new(BIO_f_base64());
+	if (!nl)
+		BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+	PUSH_OBJECT(bio,"openssl.bio");
+	return 1;
+}
+/* }}} */
+
+/* key of next bio in fenv table of a filter, set only by push */
+static char bio_next_key;
+
+/*  bio:push(bio filter) => bio{{{1
+
+	put filter in front of bio and return filter, the head of chain. filter keeps a
+	reference of bio, so bio lives at least as long as the chain. filter must not be
+	in a chain already
+*/
+LUA_FUNCTION(openssl_bio_push) {
+	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
+	BIO* filter = CHECK_OBJECT(2,BIO,"openssl.bio");
+
+	luaL_argcheck(L, filter!=bio && BIO_next(filter)==NULL, 2, "filter is in a chain, pop it first");
+	BIO_push(filter, bio);
+	lua_createtable(L,0,1);
+	lua_pushlightuserdata(L,&bio_next_key);
+	lua_pushvalue(L,1);
+	lua_rawset(L,-3);
+	lua_setfenv(L,2);
+	lua_pushvalue(L,2);
+	return 1;
+}
+/* }}} */
+
+/*  bio:pop() => bio{{{1
+
+	remove bio from head of chain and return next bio
+*/
+LUA_FUNCTION(openssl_bio_pop) {
+	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
+	BIO_pop(bio);
+	lua_getfenv(L,1);
+	if (lua_istable(L,-1)) {
+		lua_pushlightuserdata(L,&bio_next_key);
+		lua_rawget(L,-2);
+	} else
+		lua_pushnil(L);
+	lua_newtable(L);
+	lua_setfenv(L,1);
+	return 1;
+}
+/* }}} */
+
+/*  bio:get_md_ctx() => digest_ctx{{{1
+
+	return a copy of running digest of first md filter in chain, final() it to
+	get digest of data passed so far
+*/
+LUA_FUNCTION(openssl_bio_get_md_ctx) {
+	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
+	BIO* mdb = BIO_find_type(bio, BIO_TYPE_MD);
+	EVP_MD_CTX* c = NULL;
+	EVP_MD_CTX* ctx;
+
+	if (mdb==NULL || !BIO_get_md_ctx(mdb, &c) || c==NULL)
+		luaL_error(L,"no md filter in bio chain");
+
+	ctx = EVP_MD_CTX_create();
+	PUSH_OBJECT(ctx,"openssl.evp_digest_ctx");
+	if (!EVP_MD_CTX_copy_ex(ctx, c))
+		luaL_error(L,"EVP_MD_CTX_copy_ex failed");
+	return 1;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_bio_flush) {
+	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
+	lua_pushboolean(L, BIO_flush(bio)==1);
+	return 1;
+}
+
 LUA_FUNCTION(openssl_bio_read) {
 	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
 	int len = luaL_checkint(L,2);
@@ -73,8 +199,15 @@ LUA_FUNCTION(openssl_bio_gets) {
 LUA_FUNCTION(openssl_bio_write) {
 	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
 	int len = 0;
-	const char* d = luaL_checklstring(L,2, &len);
+	const char* d;
 	int ret = 1;
+	openssl_buffer* b = openssl_tobuffer(L,2);
+
+	if (b) {
+		d = (const char*)b->data;
+		len = (int)b->len;
+	} else
+		d = luaL_checklstring(L,2, &len);
 
 	len = BIO_write(bio, d, len);
 	if(len>=0){
@@ -164,6 +297,11 @@ static luaL_reg bio_funs[] = {
 	{"puts",	openssl_bio_puts	},
 
 	{"get_mem",	openssl_bio_get_mem	},
+	{"get_md_ctx",	openssl_bio_get_md_ctx	},
+
+	{"push",	openssl_bio_push	},
+	{"pop",		openssl_bio_pop		},
+	{"flush",	openssl_bio_flush	},
 
 	{"close",	openssl_bio_close	},
 	{"type",	openssl_bio_type	},
@@ -0,0 +1,134 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* buffer module for the Lua/OpenSSL binding.
+ *
+ * openssl.buffer is a growable byte buffer owned by C, functions can write output
+ * into it instead of creating a lua string for every call.
+ * buffer_new()
+ * buffer:get()
+ * buffer:clear()
+ */
+
+/* make room for more bytes after b->len, return where to write them. raise error and keep
+   b unchanged if size overflows or memory can not be allocated */
+unsigned char* openssl_buffer_reserve(lua_State* L, openssl_buffer* b, size_t more)
+{
+	if (more > (size_t)-1 - b->len)
+		luaL_error(L,"out of memory");
+	if (b->len + more > b->size) {
+		size_t need = b->len + more;
+		size_t size = b->size ? b->size : 256;
+		unsigned char* data;
+		while (size < need)
+			size = size > (size_t)-1/2 ? need : size*2;
+		data = realloc(b->data, size);
+		if (data==NULL)
+			luaL_error(L,"out of memory");
+		b->data = data;
+		b->size = size;
+	}
+	return b->data + b->len;
+}
+
+/* return buffer at idx, NULL if it is not an openssl.buffer */
+openssl_buffer* openssl_tobuffer(lua_State* L, int idx)
+{
+	openssl_buffer* b = NULL;
+	if (lua_type(L,idx)==LUA_TUSERDATA && lua_getmetatable(L,idx)) {
+		luaL_getmetatable(L,"openssl.buffer");
+		if (lua_rawequal(L,-1,-2))
+			b = *(openssl_buffer**)lua_touserdata(L,idx);
+		lua_pop(L,2);
+	}
+	return b;
+}
+
+/*  openssl.buffer_new([number size=0])->openssl.buffer{{{1
+*/
+LUA_FUNCTION(openssl_buffer_new)
+{
+	lua_Number size = luaL_optnumber(L,1,0);
+	openssl_buffer* b;
+
+	luaL_argcheck(L,size>=0 && size<=INT_MAX,1,"size out of range");
+	b = malloc(sizeof(openssl_buffer));
+	if (b==NULL)
+		return luaL_error(L,"out of memory");
+	b->data = NULL;
+	b->len = 0;
+	b->size = 0;
+	PUSH_OBJECT(b,"openssl.buffer");
+	if (size>0)
+		openssl_buffer_reserve(L,b,(size_t)size);
+	return 1;
+}
+/* }}} */
+
+/*  buffer:get([number offset=1 [,number len]])->string{{{1
+*/
+LUA_FUNCTION(openssl_buffer_get)
+{
+	openssl_buffer* b = CHECK_OBJECT(1,openssl_buffer,"openssl.buffer");
+	lua_Integer offset = luaL_optinteger(L,2,1);
+	lua_Integer len = luaL_optinteger(L,3,(lua_Integer)b->len);
+
+	if (offset<1 || (size_t)offset>b->len+1)
+		luaL_argerror(L,2,"out of range");
+	if (len<0 || (size_t)(offset-1+len)>b->len)
+		len = (lua_Integer)b->len-(offset-1);
+	lua_pushlstring(L,(const char*)b->data+offset-1,(size_t)len);
+	return 1;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_buffer_clear)
+{
+	openssl_buffer* b = CHECK_OBJECT(1,openssl_buffer,"openssl.buffer");
+	b->len = 0;
+	lua_pushvalue(L,1);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_buffer_len)
+{
+	openssl_buffer* b = CHECK_OBJECT(1,openssl_buffer,"openssl.buffer");
+	lua_pushinteger(L,(lua_Integer)b->len);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_buffer_tostring)
+{
+	openssl_buffer* b = CHECK_OBJECT(1,openssl_buffer,"openssl.buffer");
+	lua_pushfstring(L,"openssl.buffer:%p",b);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_buffer_free)
+{
+	openssl_buffer* b = CHECK_OBJECT(1,openssl_buffer,"openssl.buffer");
+	free(b->data);
+	free(b);
+	return 0;
+}
+
+static luaL_Reg buffer_funs[] = {
+	{"get",			openssl_buffer_get},
+	{"clear",		openssl_buffer_clear},
+	{"len",			openssl_buffer_len},
+
+	{"__len",		openssl_buffer_len},
+	{"__tostring",	openssl_buffer_tostring},
+	{"__gc",		openssl_buffer_free},
+	{NULL, NULL}
+};
+
+int openssl_register_buffer(lua_State* L)
+{
+	auxiliar_newclass(L,"openssl.buffer",	buffer_funs);
+	return 0;
+}
@@ -13,8 +13,9 @@ $Revision:$
  */ 
 
 /*  openssl.get_cipher([null|bool aliases=true]|string alg|int alg_id|openssl.asn1_obj|alg_obj) -> table|openssl.evp_cipher|null{{{1
-	openssl.get_cipher([bool aliases = true]) will return all ciphers methods default with alias
-	other will return a cipher method
+	openssl.get_cipher([bool aliases = true]) will return all ciphers methods default with alias,
+	the list is built once and shared, do not change it.
+	other will return a cipher method, the same userdata every time for one method
 */
 LUA_FUNCTION(openssl_get_cipher) {
 	const EVP_CIPHER* cipher = NULL;
@@ -23,22 +24,12 @@ LUA_FUNCTION(openssl_get_cipher) {
 	{
 		int aliases = lua_isnoneornil(L,1)?1:lua_toboolean(L,1);
 
-		lua_newtable(L);
-		OBJ_NAME_do_all_sorted(OBJ_NAME_TYPE_CIPHER_METH, aliases ? openssl_add_method_or_alias: openssl_add_method, L);
+		openssl_method_list(L, OBJ_NAME_TYPE_CIPHER_METH, aliases);
 		return 1;
 	}
-	if (lua_isstring(L,1))
-		cipher = EVP_get_cipherbyname(lua_tostring(L,1));
-	else if(lua_isnumber(L,1))
-		cipher = EVP_get_cipherbynid(lua_tointeger(L,1));
-	else if(auxiliar_isclass(L,"openssl.obj",1))
-		cipher = EVP_get_cipherbyobj(CHECK_OBJECT(1,ASN1_OBJECT,"openssl.asn1_object"));
-	else {
-		luaL_typerror(L,1,"please input correct paramater");
-	}
-
+	cipher = GET_CIPHER(1);
 	if(cipher)
-		PUSH_OBJECT((void*)cipher,"openssl.evp_cipher");
+		openssl_method_push(L, cipher, OBJ_NAME_TYPE_CIPHER_METH);
 	else
 		lua_pushnil(L);
 	return 1;	
@@ -65,6 +56,113 @@ LUA_FUNCTION(openssl_cipher_tostring)
 	return 1;
 }
 
+typedef int (*cipher_update_fn)(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl, const unsigned char *in, int inl);
+
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	cipher_update_fn update;
+	unsigned char* out;
+	int outl;
+} cipher_feed_t;
+
+static int openssl_cipher_feed(void* arg, const unsigned char* data, size_t len)
+{
+	cipher_feed_t* f = (cipher_feed_t*)arg;
+	int outl;
+	if (!f->update(f->ctx, f->out+f->outl, &outl, data, (int)len))
+		return 0;
+	f->outl += outl;
+	return 1;
+}
+
+/* big endian add of n blocks to counter block */
+static void openssl_counter_add(unsigned char* ctr, unsigned long long n)
+{
+	int i;
+	unsigned int carry = 0;
+	for (i=15; i>=0; i--) {
+		unsigned int s = ctr[i] + (unsigned int)(n & 0xff) + carry;
+		ctr[i] = (unsigned char)s;
+		carry = s >> 8;
+		n >>= 8;
+	}
+}
+
+/* userdata of openssl.evp_cipher_ctx, ctx must be the first member to keep CHECK_OBJECT
+   working, out is reused by every update and only grows to the largest chunk seen.
+   iv is the one given to init or reset, CTR mode does not keep it in ctx */
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	openssl_buffer out;
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	int has_iv;
+} cipher_ctx_t;
+
+static void openssl_cipher_ctx_keep_iv(cipher_ctx_t* cc, const char* iv, size_t len)
+{
+	memset(cc->iv, 0, EVP_MAX_IV_LENGTH);
+	memcpy(cc->iv, iv, len<EVP_MAX_IV_LENGTH ? len : EVP_MAX_IV_LENGTH);
+	cc->has_iv = 1;
+}
+
+static cipher_ctx_t* openssl_cipher_ctx_push(lua_State* L, EVP_CIPHER_CTX* ctx)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)lua_newuserdata(L, sizeof(cipher_ctx_t));
+	cc->ctx = ctx;
+	cc->out.data = NULL;
+	cc->out.len = 0;
+	cc->out.size = 0;
+	cc->has_iv = 0;
+	auxiliar_setclass(L,"openssl.evp_cipher_ctx",-1);
+	return cc;
+}
+
+/* run update on every argument from from in order, output is appended to out,
+   return bytes appended or -1 when update failed */
+static int openssl_cipher_ctx_feed(lua_State* L, int from, EVP_CIPHER_CTX* c, cipher_update_fn update, openssl_buffer* out)
+{
+	cipher_feed_t f;
+
+	f.ctx = c;
+	f.update = update;
+	f.outl = 0;
+	f.out = openssl_buffer_reserve(L,out,openssl_args_length(L,from)+EVP_MAX_BLOCK_LENGTH);
+
+	if (!openssl_feed_args(L,from,openssl_cipher_feed,&f))
+		return -1;
+	out->len += f.outl;
+	return f.outl;
+}
+
+/* run update on every argument from index 2 in order, push output of all pieces as one string */
+static int openssl_cipher_ctx_update(lua_State* L, cipher_update_fn update)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+
+	luaL_checkany(L,2);
+	cc->out.len = 0;
+	if (openssl_cipher_ctx_feed(L,2,cc->ctx,update,&cc->out)<0)
+		return 0;
+	lua_pushlstring(L,(const char*)cc->out.data,cc->out.len);
+	return 1;
+}
+
+typedef int (*cipher_final_fn)(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl);
+
+/* push last output, may be empty string, push nothing when final failed, as padding
+   or authentication tag check failed when decrypt */
+static int openssl_cipher_ctx_final(lua_State* L, cipher_final_fn final)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	int outl = EVP_MAX_BLOCK_LENGTH;
+	unsigned char out[EVP_MAX_BLOCK_LENGTH];
+
+	if (!final(c,out,&outl))
+		return 0;
+	lua_pushlstring(L,(const char*)out,outl);
+	return 1;
+}
+
 /*  openssl.evp_encrypt_init(openssl.evp_cipher cipher[, string key [,string iv [,openssl.engine engimp]]])->openssl.evp_cipher_ctx{{{1
 */ 
 
@@ -72,12 +170,15 @@ LUA_FUNCTION(openssl_evp_encrypt_init)
 {
 	EVP_CIPHER* c = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
 	const char* k = luaL_optstring(L,2,NULL);
-	const char* iv = luaL_optstring(L,3,NULL);
+	size_t iv_len = 0;
+	const char* iv = luaL_optlstring(L,3,NULL,&iv_len);
 	ENGINE*     e = lua_gettop(L)>3?CHECK_OBJECT(4,ENGINE,"openssl.engine"):NULL;
 
 	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-	PUSH_OBJECT(ctx,"openssl.evp_cipher_ctx");
+	cipher_ctx_t* cc = openssl_cipher_ctx_push(L,ctx);
 	EVP_CIPHER_CTX_init(ctx);
+	if (iv)
+		openssl_cipher_ctx_keep_iv(cc,iv,iv_len);
 
 	if (!EVP_EncryptInit_ex(ctx,c,e, k, iv)) {
 		luaL_error(L,"EVP_EncryptInit failed");
@@ -86,24 +187,11 @@ LUA_FUNCTION(openssl_evp_encrypt_init)
 }
 /* }}} */
 
-/*  openssl.evp_encrypt_init(openssl.evp_cipher_ctx ctx, string data)->string{{{1
+/*  openssl.evp_encrypt_update(openssl.evp_cipher_ctx ctx, string|number|table data, ...)->string{{{1
 */ 
 LUA_FUNCTION(openssl_evp_encrypt_update)
 {
-	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	int inl;
-	const char* in= luaL_checklstring(L,2,&inl);
-	int outl = inl+EVP_MAX_BLOCK_LENGTH;
-	char* out = malloc(outl);
-	
-	if(EVP_EncryptUpdate(c,out,&outl,in,inl))
-	{
-		lua_pushlstring(L,out,outl);
-		free(out);
-		return 1;
-	}
-	free(out);
-	return 0;
+	return openssl_cipher_ctx_update(L,EVP_EncryptUpdate);
 }
 /* }}} */
 
@@ -111,17 +199,7 @@ LUA_FUNCTION(openssl_evp_encrypt_update)
 */ 
 LUA_FUNCTION(openssl_evp_encrypt_final)
 {
-	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	int outl = EVP_MAX_BLOCK_LENGTH;
-	char out[EVP_MAX_BLOCK_LENGTH];
-
-	EVP_EncryptFinal_ex(c,out,&outl);
-	if(outl)
-	{
-		lua_pushlstring(L,out,outl);
-		return 1;
-	}
-	return 0;
+	return openssl_cipher_ctx_final(L,EVP_EncryptFinal_ex);
 }
 /* }}} */
 
@@ -134,12 +212,15 @@ LUA_FUNCTION(openssl_evp_decrypt_init)
 {
 	EVP_CIPHER* c = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
 	const char* k = luaL_optstring(L,2,NULL);
-	const char* iv = luaL_optstring(L,3,NULL);
+	size_t iv_len = 0;
+	const char* iv = luaL_optlstring(L,3,NULL,&iv_len);
 	ENGINE*     e = lua_gettop(L)>3?CHECK_OBJECT(4,ENGINE,"openssl.engine"):NULL;
 
 	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-	PUSH_OBJECT(ctx,"openssl.evp_cipher_ctx");
+	cipher_ctx_t* cc = openssl_cipher_ctx_push(L,ctx);
 	EVP_CIPHER_CTX_init(ctx);
+	if (iv)
+		openssl_cipher_ctx_keep_iv(cc,iv,iv_len);
 
 	if (!EVP_DecryptInit_ex(ctx,c,e, k, iv)) {
 		luaL_error(L,"EVP_DecryptInit_ex failed");
@@ -148,24 +229,11 @@ LUA_FUNCTION(openssl_evp_decrypt_init)
 }
 /* }}} */
 
-/*  openssl.evp_decrypt_update(openssl.evp_cipher_ctx ctx, string data)->string{{{1
+/*  openssl.evp_decrypt_update(openssl.evp_cipher_ctx ctx, string|number|table data, ...)->string{{{1
 */ 
 LUA_FUNCTION(openssl_evp_decrypt_update)
 {
-	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	int inl;
-	const char* in= luaL_checklstring(L,2,&inl);
-	int outl = inl+EVP_MAX_BLOCK_LENGTH;
-	char* out = malloc(outl);
-
-	if(EVP_DecryptUpdate(c,out,&outl,in,inl))
-	{
-		lua_pushlstring(L,out,outl);
-		free(out);
-		return 1;
-	}
-	free(out);
-	return 0;
+	return openssl_cipher_ctx_update(L,EVP_DecryptUpdate);
 }
 /* }}} */
 
@@ -173,16 +241,7 @@ LUA_FUNCTION(openssl_evp_decrypt_update)
 */ 
 LUA_FUNCTION(openssl_evp_decrypt_final)
 {
-	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	int outl = EVP_MAX_BLOCK_LENGTH;
-	char out[EVP_MAX_BLOCK_LENGTH];
-
-	if(EVP_DecryptFinal_ex(c,out,&outl) && outl)
-	{
-		lua_pushlstring(L,out,outl);
-		return 1;
-	}
-	return 0;
+	return openssl_cipher_ctx_final(L,EVP_DecryptFinal_ex);
 }
 /* }}} */
 
@@ -197,12 +256,15 @@ LUA_FUNCTION(openssl_evp_cipher_init)
 	int enc = auxiliar_checkboolean(L,2);
 
 	const char* k = luaL_optstring(L,3,NULL);
-	const char* iv = luaL_optstring(L,4,NULL);
+	size_t iv_len = 0;
+	const char* iv = luaL_optlstring(L,4,NULL,&iv_len);
 	ENGINE*     e = lua_gettop(L)>4? CHECK_OBJECT(5,ENGINE,"openssl.engine") :NULL;
 
 	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-	PUSH_OBJECT(ctx,"openssl.evp_cipher_ctx");
+	cipher_ctx_t* cc = openssl_cipher_ctx_push(L,ctx);
 	EVP_CIPHER_CTX_init(ctx);
+	if (iv)
+		openssl_cipher_ctx_keep_iv(cc,iv,iv_len);
 
 	if (!EVP_CipherInit_ex(ctx,c,e, k, iv,enc)) {
 		luaL_error(L,"EVP_DecryptInit_ex failed");
@@ -211,44 +273,408 @@ LUA_FUNCTION(openssl_evp_cipher_init)
 }
 /* }}} */
 
-/*  openssl.evp_cipher_update(openssl.evp_cipher_ctx ctx, string data)->string{{{1
+/*  openssl.evp_cipher_update(openssl.evp_cipher_ctx ctx, string|number|table data, ...)->string{{{1
 */ 
 LUA_FUNCTION(openssl_evp_cipher_update)
 {
-	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	int inl;
-	const char* in= luaL_checklstring(L,2,&inl);
-	int outl = inl+EVP_MAX_BLOCK_LENGTH;
-	char* out = malloc(outl);
-
-
-	if(EVP_CipherUpdate(c,out,&outl,in,inl))
-	{
-		lua_pushlstring(L,out,outl);
-		free(out);
-		return 1;
-	}
-	free(out);
-	return 0;
+	return openssl_cipher_ctx_update(L,EVP_CipherUpdate);
 }
 /* }}} */
 
 /*  openssl.evp_decrypt_final(openssl.evp_cipher_ctx ctx)->string{{{1
 */ 
 LUA_FUNCTION(openssl_evp_cipher_final)
+{
+	return openssl_cipher_ctx_final(L,EVP_CipherFinal_ex);
+}
+/* }}} */
+
+/*  cipher_ctx:reset([string key [,string iv]])->openssl.evp_cipher_ctx{{{1
+
+	reinitialise ctx in place with the same cipher and direction, key schedule is only
+	run again when key is given, with no iv the original iv is used again
+*/
+LUA_FUNCTION(openssl_cipher_ctx_reset)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	EVP_CIPHER_CTX* c = cc->ctx;
+	size_t key_len = 0, iv_len = 0;
+	const char* key = luaL_optlstring(L,2,NULL,&key_len);
+	const char* iv = luaL_optlstring(L,3,NULL,&iv_len);
+	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+
+	if (EVP_CIPHER_CTX_cipher(c)==NULL)
+		luaL_error(L,"openssl.evp_cipher_ctx is not initialized");
+	if (key)
+		memcpy(evp_key, key, key_len<EVP_MAX_KEY_LENGTH ? key_len : EVP_MAX_KEY_LENGTH);
+	if (iv) {
+		openssl_cipher_ctx_keep_iv(cc,iv,iv_len);
+		memcpy(evp_iv, cc->iv, EVP_MAX_IV_LENGTH);
+	} else if (cc->has_iv && EVP_CIPHER_CTX_mode(c)==EVP_CIPH_CTR_MODE) {
+		/* CTR mode keep counter of last update, rewind it */
+		memcpy(evp_iv, cc->iv, EVP_MAX_IV_LENGTH);
+		iv = (const char*)evp_iv;
+	}
+
+	if (!EVP_CipherInit_ex(c, NULL, NULL, key?evp_key:NULL, iv?evp_iv:NULL, -1))
+		luaL_error(L,"EVP_CipherInit_ex failed");
+	lua_pushvalue(L,1);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:seek(number offset)->openssl.evp_cipher_ctx{{{1
+
+	move CTR mode cipher_ctx to byte offset of stream started by iv given to init or
+	reset, next update work from there. key schedule is not run again
+*/
+LUA_FUNCTION(openssl_cipher_ctx_seek)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	EVP_CIPHER_CTX* c = cc->ctx;
+	lua_Number offset = luaL_checknumber(L,2);
+	unsigned char ctr[EVP_MAX_IV_LENGTH];
+	unsigned char skip[16] = {0};
+	unsigned long long blocks;
+	int rest, outl;
+
+	luaL_argcheck(L,offset>=0 && offset==floor(offset),2,"offset must be integer not less than 0");
+	if (EVP_CIPHER_CTX_cipher(c)==NULL || EVP_CIPHER_CTX_mode(c)!=EVP_CIPH_CTR_MODE
+		|| EVP_CIPHER_CTX_iv_length(c)!=16)
+		luaL_error(L,"seek only work with CTR mode cipher_ctx");
+	if (!cc->has_iv)
+		luaL_error(L,"iv is unknown, give it to init or reset");
+
+	blocks = (unsigned long long)(offset/16);
+	rest = (int)(offset - (lua_Number)blocks*16);
+	memcpy(ctr, cc->iv, EVP_MAX_IV_LENGTH);
+	openssl_counter_add(ctr, blocks);
+	if (!EVP_CipherInit_ex(c, NULL, NULL, NULL, ctr, -1)
+		|| (rest && !EVP_CipherUpdate(c, skip, &outl, skip, rest)))
+		luaL_error(L,"EVP_CipherInit_ex failed");
+	lua_pushvalue(L,1);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:update_into(openssl.buffer out, string|number|table|openssl.buffer data, ...)->number{{{1
+
+	same as update, but output is appended to out and no lua string is created,
+	return number of bytes appended
+*/
+LUA_FUNCTION(openssl_cipher_ctx_update_into)
 {
 	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	openssl_buffer* out = openssl_tobuffer(L,2);
+	int outl;
+
+	luaL_argcheck(L,out!=NULL,2,"openssl.buffer expected");
+	luaL_checkany(L,3);
+	outl = openssl_cipher_ctx_feed(L,3,c,EVP_CipherUpdate,out);
+	if (outl<0)
+		return 0;
+	lua_pushinteger(L,outl);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:final_into(openssl.buffer out)->number{{{1
+*/
+LUA_FUNCTION(openssl_cipher_ctx_final_into)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	openssl_buffer* out = openssl_tobuffer(L,2);
 	int outl = EVP_MAX_BLOCK_LENGTH;
-	char out[EVP_MAX_BLOCK_LENGTH];
 
-	if(EVP_CipherFinal_ex(c,out,&outl) && outl)
-	{
-		lua_pushlstring(L,out,outl);
-		return 1;
+	luaL_argcheck(L,out!=NULL,2,"openssl.buffer expected");
+	if (!EVP_CipherFinal_ex(c,openssl_buffer_reserve(L,out,EVP_MAX_BLOCK_LENGTH),&outl))
+		return 0;
+	out->len += outl;
+	lua_pushinteger(L,outl);
+	return 1;
+}
+/* }}} */
+
+#ifdef OPENSSL_HAVE_AEAD
+#define OPENSSL_AEAD_TAG_LENGTH	16
+
+/* GCM, CCM and ChaCha20-Poly1305 share the same ctrl codes, stitched CBC-HMAC ciphers
+   are flagged AEAD too but only work with TLS records */
+int openssl_cipher_is_aead(const EVP_CIPHER* cipher)
+{
+	int mode = EVP_CIPHER_mode(cipher);
+	return mode==EVP_CIPH_GCM_MODE || mode==EVP_CIPH_CCM_MODE
+		|| (mode!=EVP_CIPH_CBC_MODE && (EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER));
+}
+
+/*  cipher_ctx:set_iv_length(number len)->boolean{{{1
+
+	must be called before iv is set, init cipher_ctx without key and iv, then
+	give them with reset. len is at most 16, the size of iv kept by cipher_ctx
+*/
+LUA_FUNCTION(openssl_cipher_ctx_set_iv_length)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	int len = luaL_checkint(L,2);
+	/* reset copy iv to EVP_MAX_IV_LENGTH bytes, openssl would read len bytes of it */
+	luaL_argcheck(L,len>0 && len<=EVP_MAX_IV_LENGTH,2,"iv length must be in 1 to 16");
+	lua_pushboolean(L,EVP_CIPHER_CTX_ctrl(c,EVP_CTRL_GCM_SET_IVLEN,len,NULL));
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:set_aad(string aad [,number length])->boolean{{{1
+
+	add additional authenticated data, must be called before any update.
+	CCM mode need total length of data before aad, give it with length
+*/
+LUA_FUNCTION(openssl_cipher_ctx_set_aad)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	size_t aad_len;
+	const char* aad = luaL_checklstring(L,2,&aad_len);
+	int outl, ret = 1;
+
+	if (!lua_isnoneornil(L,3))
+		ret = EVP_CipherUpdate(c,NULL,&outl,NULL,luaL_checkint(L,3));
+	if (ret && aad_len)
+		ret = EVP_CipherUpdate(c,NULL,&outl,(const unsigned char*)aad,(int)aad_len);
+	lua_pushboolean(L,ret);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:set_tag(string tag)->boolean{{{1
+
+	set expected tag when decrypt, must be called before final. CCM mode need
+	it before key is set
+*/
+LUA_FUNCTION(openssl_cipher_ctx_set_tag)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	size_t tag_len;
+	const char* tag = luaL_checklstring(L,2,&tag_len);
+	lua_pushboolean(L,EVP_CIPHER_CTX_ctrl(c,EVP_CTRL_GCM_SET_TAG,(int)tag_len,(void*)tag));
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:get_tag([number len=16])->string{{{1
+
+	return tag after final when encrypt, nil if it is not available
+*/
+LUA_FUNCTION(openssl_cipher_ctx_get_tag)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	int len = luaL_optint(L,2,OPENSSL_AEAD_TAG_LENGTH);
+	unsigned char tag[OPENSSL_AEAD_TAG_LENGTH];
+
+	luaL_argcheck(L,len>0 && len<=OPENSSL_AEAD_TAG_LENGTH,2,"tag length out of range");
+	if (!EVP_CIPHER_CTX_ctrl(c,EVP_CTRL_GCM_GET_TAG,len,tag))
+		return 0;
+	lua_pushlstring(L,(const char*)tag,len);
+	return 1;
+}
+/* }}} */
+#endif
+
+#ifdef EVP_CTRL_AEAD_TLS1_AAD
+/* {{{ stitched CBC-HMAC ciphers, like aes-128-cbc-hmac-sha1, work on whole TLS records */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define CIPHER_CTX_ENCRYPTING(c)	EVP_CIPHER_CTX_encrypting(c)
+#else
+#define CIPHER_CTX_ENCRYPTING(c)	((c)->encrypt)
+#endif
+#define TLS_AAD_LENGTH		13
+
+/* TLS AAD from seq, type and version at idx, length is filled later */
+static void openssl_tls_aad(lua_State* L, int idx, unsigned char* aad)
+{
+	int version = luaL_checkint(L, idx+2);
+	memset(aad, 0, TLS_AAD_LENGTH);
+	if (lua_type(L, idx)==LUA_TSTRING) {
+		size_t len;
+		const char* seq = lua_tolstring(L, idx, &len);
+		luaL_argcheck(L, len==8, idx, "sequence must be 8 bytes");
+		memcpy(aad, seq, 8);
+	} else {
+		lua_Number n = luaL_checknumber(L, idx);
+		int i;
+		luaL_argcheck(L, n>=0 && n==floor(n), idx, "sequence must be integer not less than 0");
+		for (i=7; i>=0; i--) {
+			lua_Number q = floor(n/256);
+			aad[i] = (unsigned char)(n - q*256);
+			n = q;
+		}
 	}
-	return 0;
+	aad[8] = (unsigned char)luaL_checkint(L, idx+1);
+	aad[9] = (unsigned char)(version>>8);
+	aad[10] = (unsigned char)version;
+}
+
+/* seal or open one record into out, return 0 if MAC or padding is wrong. data of TLS 1.1
+   and later start with explicit iv, so does the output */
+static int openssl_tls_record(lua_State* L, EVP_CIPHER_CTX* c, openssl_buffer* out, unsigned char* aad,
+	const unsigned char* in, size_t inl, size_t* off, size_t* len)
+{
+	int enc = CIPHER_CTX_ENCRYPTING(c);
+	int ivlen = (aad[9]<<8 | aad[10]) >= 0x0302 ? 16 : 0;
+	unsigned char* p;
+	int n;
+
+	/* length must fit aad before ctx take it */
+	if (inl>0xffff)
+		return 0;
+	aad[11] = (unsigned char)(inl>>8);
+	aad[12] = (unsigned char)inl;
+	/* return padding and MAC bytes to add when encrypt, MAC size when decrypt */
+	n = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_TLS1_AAD, TLS_AAD_LENGTH, aad);
+	if (n<=0)
+		return 0;
+
+	out->len = 0;
+	p = openssl_buffer_reserve(L, out, inl + (enc ? n : 0));
+	memcpy(p, in, inl);
+	if (enc) {
+		if (EVP_Cipher(c, p, p, (unsigned int)(inl+n))<=0)
+			return 0;
+		*off = 0;
+		*len = inl+n;
+	} else {
+		/* padding length is last byte, keep len from going below 0 */
+		if (inl==0 || EVP_Cipher(c, p, p, (unsigned int)inl)<=0
+			|| inl < (size_t)ivlen + n + p[inl-1] + 1)
+			return 0;
+		*off = ivlen;
+		*len = inl - ivlen - n - p[inl-1] - 1;
+	}
+	return 1;
+}
+
+static void openssl_tls_seq_next(unsigned char* aad)
+{
+	int i = 7;
+	while (i>=0 && ++aad[i]==0)
+		i--;
+}
+
+/*  cipher_ctx:set_mac_key(string key)->boolean{{{1
+
+	set HMAC key of stitched cipher, after key and iv are given
+*/
+LUA_FUNCTION(openssl_cipher_ctx_set_mac_key)
+{
+	EVP_CIPHER_CTX* c = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+	size_t len;
+	const char* key = luaL_checklstring(L, 2, &len);
+	lua_pushboolean(L, EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_MAC_KEY, (int)len, (void*)key)>0);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:tls_record(string|number seq, number type, number version, string data)->string{{{1
+
+	encrypt: data is payload, with explicit iv first for TLS 1.1 and later, return it
+	followed by MAC and padding encrypted. decrypt: data is record body, return payload,
+	nil if MAC or padding is wrong
+*/
+LUA_FUNCTION(openssl_cipher_ctx_tls_record)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	size_t inl, off, len;
+	const char* in = luaL_checklstring(L, 5, &inl);
+	unsigned char aad[TLS_AAD_LENGTH];
+
+	openssl_tls_aad(L, 2, aad);
+	if (!openssl_tls_record(L, cc->ctx, &cc->out, aad, (const unsigned char*)in, inl, &off, &len))
+		return 0;
+	lua_pushlstring(L, (const char*)cc->out.data+off, len);
+	return 1;
+}
+/* }}} */
+
+/*  cipher_ctx:tls_records(string|number seq, number type, number version, table records)->table{{{1
+
+	same as tls_record for every record, sequence number increase by one for each.
+	return nil and index of record if one failed
+*/
+LUA_FUNCTION(openssl_cipher_ctx_tls_records)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	unsigned char aad[TLS_AAD_LENGTH];
+	int i, n;
+
+	openssl_tls_aad(L, 2, aad);
+	luaL_checktype(L, 5, LUA_TTABLE);
+	n = lua_objlen(L, 5);
+	lua_createtable(L, n, 0);
+	for (i=1; i<=n; i++) {
+		size_t inl, off, len;
+		const char* in;
+		int ok;
+
+		lua_rawgeti(L, 5, i);
+		in = lua_tolstring(L, -1, &inl);
+		if (in==NULL)
+			luaL_error(L, "#5 item %d must be string", i);
+		ok = openssl_tls_record(L, cc->ctx, &cc->out, aad, (const unsigned char*)in, inl, &off, &len);
+		lua_pop(L, 1);
+		if (!ok) {
+			lua_pushnil(L);
+			lua_pushinteger(L, i);
+			return 2;
+		}
+		lua_pushlstring(L, (const char*)cc->out.data+off, len);
+		lua_rawseti(L, -2, i);
+		openssl_tls_seq_next(aad);
+	}
+	return 1;
+}
+/* }}} */
+
+#ifdef EVP_CTRL_TLS1_1_MULTIBLOCK_AAD
+/*  cipher_ctx:tls_multiblock(string|number seq, number type, number version, string data [,number interleave=4])->string,number{{{1
+
+	encrypt data as interleave TLS 1.1 or later records in one pass, return them with
+	headers and number of records made, caller must add it to seq. return nil if the
+	cipher or CPU can not do multi block, or data is too short
+*/
+LUA_FUNCTION(openssl_cipher_ctx_tls_multiblock)
+{
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	size_t inl;
+	const char* in = luaL_checklstring(L, 5, &inl);
+	int interleave = luaL_optint(L, 6, 4);
+	EVP_CTRL_TLS1_1_MULTIBLOCK_PARAM mb;
+	unsigned char aad[TLS_AAD_LENGTH];
+	int packlen, n;
+
+	luaL_argcheck(L, interleave==4 || interleave==8, 6, "interleave must be 4 or 8");
+	openssl_tls_aad(L, 2, aad);
+	memset(&mb, 0, sizeof(mb));
+	mb.inp = aad;
+	mb.len = inl;
+	mb.interleave = interleave;
+	packlen = EVP_CIPHER_CTX_ctrl(cc->ctx, EVP_CTRL_TLS1_1_MULTIBLOCK_AAD, sizeof(mb), &mb);
+	if (packlen<=0)
+		return 0;
+
+	cc->out.len = 0;
+	mb.out = openssl_buffer_reserve(L, &cc->out, packlen);
+	mb.inp = (const unsigned char*)in;
+	mb.len = inl;
+	n = EVP_CIPHER_CTX_ctrl(cc->ctx, EVP_CTRL_TLS1_1_MULTIBLOCK_ENCRYPT, sizeof(mb), &mb);
+	if (n<=0)
+		return 0;
+	lua_pushlstring(L, (const char*)mb.out, n);
+	lua_pushinteger(L, mb.interleave);
+	return 2;
 }
 /* }}} */
+#endif
+/* }}} */
+#endif
 
 LUA_FUNCTION(openssl_cipher_ctx_info)
 {
@@ -261,7 +687,7 @@ LUA_FUNCTION(openssl_cipher_ctx_info)
 	add_assoc_int(L,"nid", EVP_CIPHER_CTX_nid(ctx));
 	add_assoc_int(L,"type", EVP_CIPHER_CTX_mode(ctx));
 	add_assoc_int(L,"mode", EVP_CIPHER_CTX_type(ctx));
-	PUSH_OBJECT((void*)EVP_CIPHER_CTX_cipher(ctx),"openssl.evp_cipher");
+	openssl_method_push(L,EVP_CIPHER_CTX_cipher(ctx),OBJ_NAME_TYPE_CIPHER_METH);
 	lua_setfield(L,-2,"cipher");
 	return 1;
 }
@@ -273,8 +699,9 @@ LUA_FUNCTION(openssl_cipher_ctx_tostring) {
 }
 
 LUA_FUNCTION(openssl_cipher_ctx_free) {
-	EVP_CIPHER_CTX *ctx = CHECK_OBJECT(1,EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
-	EVP_CIPHER_CTX_free(ctx);
+	cipher_ctx_t* cc = (cipher_ctx_t*)luaL_checkudata(L,1,"openssl.evp_cipher_ctx");
+	EVP_CIPHER_CTX_free(cc->ctx);
+	free(cc->out.data);
 	return 0;
 }
 
@@ -284,6 +711,15 @@ LUA_FUNCTION(openssl_cipher_ctx_cleanup) {
 	return 1;
 }
 
+/* output of one shot encrypt or decrypt of inl bytes, small output stay on the stack */
+#define OPENSSL_CIPHER_BUFFER(stack, inl)	\
+	((size_t)(inl)+EVP_MAX_BLOCK_LENGTH <= sizeof(stack) ? (stack) : malloc((inl)+EVP_MAX_BLOCK_LENGTH))
+
+/*  evp_cipher:encrypt(string data [,string key [,string iv [,string format='raw' [,openssl.engine engimp]]]])->string{{{1
+
+	format of output can be raw, hex, base64 or base64url, engimp may also be given in
+	place of format
+*/
 LUA_FUNCTION(openssl_evp_encrypt){
 	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
 	int input_len = 0;
@@ -292,12 +728,14 @@ LUA_FUNCTION(openssl_evp_encrypt){
 	const char *key = luaL_optlstring(L, 3, NULL, &key_len); /* can be NULL */
 	size_t iv_len = 0;
 	const char *iv = luaL_optlstring(L, 4, NULL, &iv_len); /* can be NULL */
-	ENGINE *e = lua_isnoneornil(L,5) ? NULL : CHECK_OBJECT(5, ENGINE, "openssl.engine");
+	ENGINE *e;
+	int format = openssl_get_format_engine(L, 5, &e);
 	EVP_CIPHER_CTX c;
 
 	int output_len = 0;
 	int len = 0;
 	unsigned char *buffer = NULL;
+	unsigned char stack[LUAL_BUFFERSIZE];
 	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
 	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
 
@@ -318,16 +756,24 @@ LUA_FUNCTION(openssl_evp_encrypt){
 	{
 		luaL_error(L, "EVP_DecryptInit_ex failed, please check openssl error");
 	}
-	buffer = malloc(input_len + EVP_CIPHER_CTX_block_size(&c));
+	buffer = OPENSSL_CIPHER_BUFFER(stack, input_len);
 	EVP_EncryptUpdate(&c, buffer, &len, input, input_len);
 	output_len += len;
-	EVP_EncryptFinal(&c, buffer+len, &len);
+	EVP_EncryptFinal_ex(&c, buffer+len, &len);
 	output_len += len;
-	lua_pushlstring(L, (char*) buffer, output_len);
-	free(buffer);
+	EVP_CIPHER_CTX_cleanup(&c);
+	openssl_push_format(L, buffer, output_len, format);
+	if (buffer!=stack)
+		free(buffer);
 	return 1;
 }
+/* }}} */
 
+/*  evp_cipher:decrypt(string data [,string key [,string iv [,string format='raw' [,openssl.engine engimp]]]])->string{{{1
+
+	format of input data can be raw, hex, base64 or base64url, engimp may also be given
+	in place of format
+*/
 LUA_FUNCTION(openssl_evp_decrypt){
 	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
 	int input_len = 0;
@@ -336,12 +782,15 @@ LUA_FUNCTION(openssl_evp_decrypt){
 	const char *key = luaL_optlstring(L, 3, NULL, &key_len); /* can be NULL */
 	size_t iv_len = 0;
 	const char *iv = luaL_optlstring(L, 4, NULL, &iv_len); /* can be NULL */
-	ENGINE *e = lua_isnoneornil(L,5) ? NULL : CHECK_OBJECT(5, ENGINE, "openssl.engine");
+	ENGINE *e;
+	int format = openssl_get_format_engine(L, 5, &e);
 	EVP_CIPHER_CTX c;
+	unsigned char *decoded = NULL;
 
 	int output_len = 0;
 	int len = 0;
 	unsigned char *buffer = NULL;
+	unsigned char stack[LUAL_BUFFERSIZE];
 	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
 	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
 	if (key)
@@ -362,16 +811,805 @@ LUA_FUNCTION(openssl_evp_decrypt){
 		luaL_error(L, "EVP_DecryptInit_ex failed, please check openssl error");
 	}
 
-	buffer = malloc(input_len);
+	if (format!=OPENSSL_FORMAT_RAW)
+	{
+		size_t decoded_len;
+		decoded = openssl_decode_format(input, input_len, format, &decoded_len);
+		if (decoded==NULL)
+		{
+			EVP_CIPHER_CTX_cleanup(&c);
+			luaL_error(L, "#2 is not valid encoded data");
+		}
+		input = (const char*)decoded;
+		input_len = (int)decoded_len;
+	}
+
+	buffer = OPENSSL_CIPHER_BUFFER(stack, input_len);
 	EVP_DecryptUpdate(&c, buffer, &len, input, input_len);
 	output_len += len;
-	EVP_DecryptFinal(&c, buffer+len, &len);
+	EVP_DecryptFinal_ex(&c, buffer+len, &len);
 	output_len += len;
+	EVP_CIPHER_CTX_cleanup(&c);
 	lua_pushlstring(L, (char*) buffer, output_len);
-	free(buffer);
+	if (buffer!=stack)
+		free(buffer);
+	if (decoded)
+		free(decoded);
+	return 1;
+}
+/* }}} */
+
+/* big endian increment of iv, used to give every record its own iv */
+static void openssl_iv_increment(unsigned char* iv, int len)
+{
+	while (len-- > 0 && ++iv[len]==0)
+		;
+}
+
+/* encrypt or decrypt every record with the same key schedule, iv of record i is ivs[i],
+   gen(i), or iv string plus i-1 */
+static int openssl_cipher_crypt_many(lua_State* L, int enc)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	size_t key_len = 0;
+	const char* key = luaL_checklstring(L, 3, &key_len);
+	int packed = lua_toboolean(L, 5);
+	ENGINE *e = lua_isnoneornil(L,6) ? NULL : CHECK_OBJECT(6, ENGINE, "openssl.engine");
+	int iv_len = EVP_CIPHER_iv_length(cipher);
+	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+	unsigned char counter[EVP_MAX_IV_LENGTH] = {0};
+	cipher_ctx_t* cc;
+	int n, i, res;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_argcheck(L, lua_istable(L,4) || lua_isstring(L,4) || lua_isfunction(L,4), 4,
+		"table, string or function expected");
+	n = lua_objlen(L, 2);
+	memcpy(evp_key, key, key_len<EVP_MAX_KEY_LENGTH ? key_len : EVP_MAX_KEY_LENGTH);
+	if (lua_type(L,4)==LUA_TSTRING) {
+		size_t len;
+		const char* iv = lua_tolstring(L, 4, &len);
+		memcpy(counter, iv, len<EVP_MAX_IV_LENGTH ? len : EVP_MAX_IV_LENGTH);
+	}
+
+	/* ctx and its output buffer are collected by lua if an iv function raise error */
+	cc = openssl_cipher_ctx_push(L, EVP_CIPHER_CTX_new());
+	if (!EVP_CipherInit_ex(cc->ctx, cipher, e, evp_key, NULL, enc))
+		luaL_error(L, "EVP_CipherInit_ex failed, please check openssl error");
+	lua_createtable(L, packed ? n+1 : n, 0);
+	res = lua_gettop(L);
+
+	for (i=1; i<=n; i++)
+	{
+		size_t inl;
+		const char* in;
+		unsigned char* out;
+		int len, outl, ok;
+
+		if (lua_type(L,4)==LUA_TSTRING) {
+			memcpy(evp_iv, counter, EVP_MAX_IV_LENGTH);
+			openssl_iv_increment(counter, iv_len);
+		} else {
+			size_t l;
+			const char* iv;
+			if (lua_istable(L,4))
+				lua_rawgeti(L, 4, i);
+			else {
+				lua_pushvalue(L, 4);
+				lua_pushinteger(L, i);
+				lua_call(L, 1, 1);
+			}
+			iv = lua_tolstring(L, -1, &l);
+			if (iv==NULL)
+				luaL_error(L, "#4 iv of record %d must be string", i);
+			memset(evp_iv, 0, EVP_MAX_IV_LENGTH);
+			memcpy(evp_iv, iv, l<EVP_MAX_IV_LENGTH ? l : EVP_MAX_IV_LENGTH);
+			lua_pop(L, 1);
+		}
+
+		lua_rawgeti(L, 2, i);
+		in = lua_tolstring(L, -1, &inl);
+		if (in==NULL)
+			luaL_error(L, "#2 item %d must be string", i);
+
+		if (packed) {
+			lua_pushinteger(L, (lua_Integer)cc->out.len+1);
+			lua_rawseti(L, res, i);
+		} else
+			cc->out.len = 0;
+		out = openssl_buffer_reserve(L, &cc->out, inl+EVP_MAX_BLOCK_LENGTH);
+		ok = EVP_CipherInit_ex(cc->ctx, NULL, NULL, NULL, evp_iv, -1)
+			&& EVP_CipherUpdate(cc->ctx, out, &outl, (const unsigned char*)in, (int)inl)
+			&& EVP_CipherFinal_ex(cc->ctx, out+outl, &len);
+		lua_pop(L, 1);
+		if (!ok) {
+			lua_pushnil(L);
+			lua_pushinteger(L, i);
+			return 2;
+		}
+		cc->out.len += outl+len;
+
+		if (!packed) {
+			lua_pushlstring(L, (const char*)out, outl+len);
+			lua_rawseti(L, res, i);
+		}
+	}
+
+	if (packed) {
+		lua_pushinteger(L, (lua_Integer)cc->out.len+1);
+		lua_rawseti(L, res, n+1);
+		lua_pushlstring(L, (const char*)cc->out.data, cc->out.len);
+		lua_insert(L, res);
+		return 2;
+	}
+	return 1;
+}
+
+/*  evp_cipher:encrypt_many(table records, string key, table ivs|string iv|function gen [,boolean packed=false [,openssl.engine engimp]])->table|string,table{{{1
+
+	encrypt every record with key schedule done once. iv of record i is ivs[i], gen(i),
+	or iv as big endian number plus i-1. return array of results, or when packed is
+	true one string with all results and a table of n+1 offsets, result i is
+	s:sub(offsets[i], offsets[i+1]-1). return nil and index of record if one failed
+*/
+LUA_FUNCTION(openssl_evp_encrypt_many)
+{
+	return openssl_cipher_crypt_many(L, 1);
+}
+/* }}} */
+
+/*  evp_cipher:decrypt_many(table records, string key, table ivs|string iv|function gen [,boolean packed=false [,openssl.engine engimp]])->table|string,table{{{1
+*/
+LUA_FUNCTION(openssl_evp_decrypt_many)
+{
+	return openssl_cipher_crypt_many(L, 0);
+}
+/* }}} */
+
+#ifdef EVP_CIPH_XTS_MODE
+/*  evp_cipher:xts_sectors(string data, string key, number first_sector, number sector_size [,bool enc=true])->string{{{1
+
+	encrypt or decrypt data as consecutive sectors of sector_size bytes with XTS mode, tweak
+	of every sector is its number as 16 bytes little endian, numbered from first_sector.
+	key schedule is done once, only tweak is set for each sector
+*/
+LUA_FUNCTION(openssl_evp_xts_sectors)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	size_t inl, key_len;
+	const char* in = luaL_checklstring(L, 2, &inl);
+	const char* key = luaL_checklstring(L, 3, &key_len);
+	lua_Number first = luaL_checknumber(L, 4);
+	lua_Integer sector = luaL_checkinteger(L, 5);
+	int enc = lua_isnoneornil(L, 6) ? 1 : lua_toboolean(L, 6);
+	cipher_ctx_t* cc;
+	size_t off;
+	int outl;
+
+	luaL_argcheck(L, EVP_CIPHER_mode(cipher)==EVP_CIPH_XTS_MODE, 1, "XTS cipher expected");
+	luaL_argcheck(L, key_len==(size_t)EVP_CIPHER_key_length(cipher), 3, "wrong key length");
+	luaL_argcheck(L, first>=0 && first==floor(first), 4, "sector number must be integer not less than 0");
+	luaL_argcheck(L, sector>=16 && sector<=INT_MAX, 5, "sector size out of range");
+	luaL_argcheck(L, inl % (size_t)sector == 0, 2, "length must be multiple of sector size");
+
+	cc = openssl_cipher_ctx_push(L, EVP_CIPHER_CTX_new());
+	if (!EVP_CipherInit_ex(cc->ctx, cipher, NULL, (const unsigned char*)key, NULL, enc))
+		luaL_error(L, "EVP_CipherInit_ex failed, please check openssl error");
+	openssl_buffer_reserve(L, &cc->out, inl ? inl : 1);
+
+	for (off=0; off<inl; off+=(size_t)sector)
+	{
+		unsigned char tweak[16] = {0};
+		unsigned long long n = (unsigned long long)first + off/(size_t)sector;
+		int i;
+		for (i=0; i<8; i++, n>>=8)
+			tweak[i] = (unsigned char)n;
+		if (!EVP_CipherInit_ex(cc->ctx, NULL, NULL, NULL, tweak, -1)
+			|| !EVP_CipherUpdate(cc->ctx, cc->out.data+off, &outl, (const unsigned char*)in+off, (int)sector))
+			luaL_error(L, "XTS of sector %f failed, please check openssl error", (lua_Number)(first + off/(size_t)sector));
+	}
+	lua_pushlstring(L, (const char*)cc->out.data, inl);
+	return 1;
+}
+/* }}} */
+#endif
+
+/* {{{ file to file encrypt and decrypt */
+#define OPENSSL_CIPHER_FILE_CHUNK	(64*1024)
+
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	EVP_MD_CTX* md;
+	int enc;
+	unsigned char* out;
+	FILE* fp;
+	lua_Number total;
+} cipher_file_t;
+
+/* write out and digest plain text, digest input when encrypt, output when decrypt */
+static int openssl_cipher_file_write(cipher_file_t* f, const unsigned char* in, size_t inl, int outl)
+{
+	if (f->md)
+		EVP_DigestUpdate(f->md, f->enc ? in : f->out, f->enc ? inl : (size_t)outl);
+	if (fwrite(f->out, 1, outl, f->fp)!=(size_t)outl)
+		return 0;
+	f->total += outl;
+	return 1;
+}
+
+/* pieces given by openssl_file_feed may be large mapped windows, cut them to chunks
+   so only one chunk of output buffer is needed */
+static int openssl_cipher_file_feed(void* arg, const unsigned char* data, size_t len)
+{
+	cipher_file_t* f = (cipher_file_t*)arg;
+	while (len) {
+		size_t n = len < OPENSSL_CIPHER_FILE_CHUNK ? len : OPENSSL_CIPHER_FILE_CHUNK;
+		int outl;
+		if (!EVP_CipherUpdate(f->ctx, f->out, &outl, data, (int)n)
+			|| !openssl_cipher_file_write(f, data, n, outl))
+			return 0;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int openssl_cipher_file(lua_State* L, int enc)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	const char* in = luaL_checkstring(L, 2);
+	const char* out = luaL_checkstring(L, 3);
+	size_t key_len = 0, iv_len = 0, aad_len = 0, tag_len = 0;
+	const char* key = luaL_checklstring(L, 4, &key_len);
+	const char* iv = luaL_optlstring(L, 5, NULL, &iv_len);
+	const char* aad = openssl_opt_lstring(L, 6, "aad", &aad_len);
+	const char* tag = openssl_opt_lstring(L, 6, "tag", &tag_len);
+	const EVP_MD* md = NULL;
+	int format = OPENSSL_FORMAT_RAW;
+	int aead = 0;
+	unsigned char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+	unsigned char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+	unsigned char mdv[EVP_MAX_MD_SIZE];
+	unsigned int mdl = 0;
+	cipher_file_t f;
+	int outl, ok, n = 1;
+
+	if (!lua_isnoneornil(L, 6)) {
+		lua_getfield(L, 6, "digest");
+		if (!lua_isnil(L, -1)) {
+			md = GET_DIGEST(-1);
+			if (md==NULL)
+				luaL_error(L, "option digest is unknown digest method");
+		}
+		lua_getfield(L, 6, "format");
+		format = openssl_get_format(L, -1);
+		lua_pop(L, 2);
+	}
+#ifdef OPENSSL_HAVE_AEAD
+	aead = openssl_cipher_is_aead(cipher);
+	luaL_argcheck(L, EVP_CIPHER_mode(cipher)!=EVP_CIPH_CCM_MODE, 1, "CCM mode is not supported");
+	if (aead && !enc && tag==NULL)
+		luaL_error(L, "option tag is needed to decrypt with AEAD cipher");
+#endif
+	memcpy(evp_key, key, key_len<EVP_MAX_KEY_LENGTH ? key_len : EVP_MAX_KEY_LENGTH);
+	if (iv)
+		memcpy(evp_iv, iv, iv_len<EVP_MAX_IV_LENGTH ? iv_len : EVP_MAX_IV_LENGTH);
+
+	/* ctx and output buffer are owned by lua, only file and md ctx need to be closed */
+	f.ctx = openssl_cipher_ctx_push(L, EVP_CIPHER_CTX_new())->ctx;
+	f.out = lua_newuserdata(L, OPENSSL_CIPHER_FILE_CHUNK+EVP_MAX_BLOCK_LENGTH);
+	f.enc = enc;
+	f.total = 0;
+	ok = EVP_CipherInit_ex(f.ctx, cipher, NULL, NULL, NULL, enc);
+#ifdef OPENSSL_HAVE_AEAD
+	if (ok && aead && iv)
+		ok = EVP_CIPHER_CTX_ctrl(f.ctx, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, NULL);
+#endif
+	/* iv of AEAD cipher has iv_len bytes set above, may be longer than evp_iv */
+	ok = ok && EVP_CipherInit_ex(f.ctx, NULL, NULL, evp_key,
+		iv ? (aead ? (const unsigned char*)iv : evp_iv) : NULL, enc);
+	if (ok && aead && aad_len)
+		ok = EVP_CipherUpdate(f.ctx, NULL, &outl, (const unsigned char*)aad, (int)aad_len);
+	if (!ok)
+		luaL_error(L, "EVP_CipherInit_ex failed, please check openssl error");
+
+	f.fp = fopen(out, "wb");
+	if (f.fp==NULL)
+		luaL_error(L, "can not open file(%s)", out);
+	f.md = md ? EVP_MD_CTX_create() : NULL;
+	if (f.md)
+		EVP_DigestInit_ex(f.md, md, NULL);
+
+	ok = openssl_file_feed(in, 0, -1, openssl_cipher_file_feed, &f);
+	if (ok) {
+#ifdef OPENSSL_HAVE_AEAD
+		if (aead && !enc && !EVP_CIPHER_CTX_ctrl(f.ctx, EVP_CTRL_GCM_SET_TAG, (int)tag_len, (void*)tag))
+			ok = -1;
+#endif
+		if (ok>0 && !EVP_CipherFinal_ex(f.ctx, f.out, &outl))
+			ok = -1;
+		if (ok>0 && !openssl_cipher_file_write(&f, NULL, 0, outl))
+			ok = 0;
+	}
+	if (fclose(f.fp)!=0 && ok>0)
+		ok = 0;
+	if (f.md) {
+		EVP_DigestFinal_ex(f.md, mdv, &mdl);
+		EVP_MD_CTX_destroy(f.md);
+	}
+
+	if (ok<=0) {
+		remove(out);
+		if (ok==0)
+			luaL_error(L, "%s file(%s) to file(%s) failed", enc ? "encrypt" : "decrypt", in, out);
+		return 0;
+	}
+
+	lua_pushnumber(L, f.total);
+	if (md) {
+		openssl_push_format(L, mdv, mdl, format);
+		n++;
+	}
+#ifdef OPENSSL_HAVE_AEAD
+	if (aead && enc) {
+		unsigned char t[OPENSSL_AEAD_TAG_LENGTH];
+		if (!EVP_CIPHER_CTX_ctrl(f.ctx, EVP_CTRL_GCM_GET_TAG, OPENSSL_AEAD_TAG_LENGTH, t))
+			luaL_error(L, "EVP_CIPHER_CTX_ctrl failed, please check openssl error");
+		lua_pushlstring(L, (const char*)t, OPENSSL_AEAD_TAG_LENGTH);
+		n++;
+	}
+#endif
+	return n;
+}
+
+/*  evp_cipher:encrypt_file(string in, string out, string key [,string iv [,table opts]])->number [,string digest] [,string tag]{{{1
+
+	encrypt file in to file out chunk by chunk with fixed memory, return number of bytes
+	written. opts.digest is name or openssl.evp_digest to hash plain text in the same pass,
+	its result is returned encoded by opts.format. AEAD cipher take opts.aad and return tag
+*/
+LUA_FUNCTION(openssl_evp_encrypt_file)
+{
+	return openssl_cipher_file(L, 1);
+}
+/* }}} */
+
+/*  evp_cipher:decrypt_file(string in, string out, string key [,string iv [,table opts]])->number [,string digest]{{{1
+
+	same as encrypt_file, AEAD cipher need opts.tag. return nil and remove file out if
+	padding or tag check failed
+*/
+LUA_FUNCTION(openssl_evp_decrypt_file)
+{
+	return openssl_cipher_file(L, 0);
+}
+/* }}} */
+/* }}} */
+
+#ifdef OPENSSL_HAVE_AEAD
+/* {{{ parallel CTR and GCM
+
+   CTR key stream of byte offset off only depends on counter + off/16, so data is cut in
+   chunks encrypted by different threads. For GCM the cipher text is produced by CTR from
+   counter J0+1, GHASH of every chunk is computed with OpenSSL as GCM tag of AAD only and
+   combined with GF(2^128) multiplies by powers of H, the result is the same as one pass */
+#define OPENSSL_PARALLEL_CHUNK	(1024*1024)
+#define OPENSSL_GCM_MAX_LENGTH	(((lua_Number)0xfffffffeU)*16)
+
+/* x = x*y in GF(2^128) with GCM bit order */
+static void gf128_mul(unsigned char* x, const unsigned char* y)
+{
+	unsigned char z[16] = {0};
+	unsigned char v[16];
+	int i, j, k, lsb;
+
+	memcpy(v, y, 16);
+	for (i=0; i<16; i++) {
+		for (j=7; j>=0; j--) {
+			if ((x[i]>>j) & 1)
+				for (k=0; k<16; k++)
+					z[k] ^= v[k];
+			lsb = v[15] & 1;
+			for (k=15; k>0; k--)
+				v[k] = (unsigned char)((v[k]>>1) | (v[k-1]<<7));
+			v[0] >>= 1;
+			if (lsb)
+				v[0] ^= 0xe1;
+		}
+	}
+	memcpy(x, z, 16);
+}
+
+/* x = x*h^n */
+static void gf128_mul_pow(unsigned char* x, const unsigned char* h, size_t n)
+{
+	unsigned char p[16];
+	memcpy(p, h, 16);
+	while (n) {
+		if (n & 1)
+			gf128_mul(x, p);
+		n >>= 1;
+		if (n)
+			gf128_mul(p, p);
+	}
+}
+
+/* x ^= length block of bytes of aad and bytes of cipher text, times h */
+static void gf128_add_length(unsigned char* x, const unsigned char* h, lua_Number aad, lua_Number data)
+{
+	unsigned char l[16];
+	unsigned long long a = (unsigned long long)aad*8, d = (unsigned long long)data*8;
+	int i;
+	for (i=7; i>=0; i--, a>>=8, d>>=8) {
+		l[i] = (unsigned char)a;
+		l[i+8] = (unsigned char)d;
+	}
+	gf128_mul(l, h);
+	for (i=0; i<16; i++)
+		x[i] ^= l[i];
+}
+
+typedef struct {
+	const EVP_CIPHER* ctr;		/* cipher to make key stream */
+	const EVP_CIPHER* gcm;		/* NULL for CTR */
+	const unsigned char* key;
+	const unsigned char* iv;
+	unsigned char counter[16];	/* counter block of first byte of in */
+	const unsigned char* in;
+	unsigned char* out;
+	size_t len;
+	size_t chunk;
+	unsigned char* tags;		/* GCM tag of every chunk as AAD, 16 bytes for each job */
+	int failed;
+
+	unsigned char h[16];		/* GCM hash key */
+	unsigned char ek0[16];		/* encrypted J0 */
+	unsigned char xh[16];		/* GHASH of aad and data so far, times h */
+	lua_Number aad_len;
+	lua_Number data_len;
+} cipher_parallel_t;
+
+static void openssl_cipher_parallel_job(void* arg, int i)
+{
+	cipher_parallel_t* p = (cipher_parallel_t*)arg;
+	size_t off = (size_t)i*p->chunk;
+	size_t n = p->len-off < p->chunk ? p->len-off : p->chunk;
+	EVP_CIPHER_CTX* c = EVP_CIPHER_CTX_new();
+	unsigned char ctr[16];
+	int outl, ok;
+
+	memcpy(ctr, p->counter, 16);
+	openssl_counter_add(ctr, off/16);
+	ok = EVP_EncryptInit_ex(c, p->ctr, NULL, p->key, ctr)
+		&& EVP_EncryptUpdate(c, p->out+off, &outl, p->in+off, (int)n);
+	if (ok && p->gcm)
+		ok = EVP_EncryptInit_ex(c, p->gcm, NULL, p->key, p->iv)
+			&& EVP_EncryptUpdate(c, NULL, &outl, p->out+off, (int)n)
+			&& EVP_EncryptFinal_ex(c, ctr, &outl)
+			&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_GET_TAG, 16, p->tags+16*i);
+	EVP_CIPHER_CTX_free(c);
+	if (!ok)
+		p->failed = 1;
+}
+
+/* GCM tag of aad with no data, is ek0 xor GHASH(aad, length) */
+static int openssl_gcm_aad_tag(cipher_parallel_t* p, const unsigned char* aad, size_t len, unsigned char* tag)
+{
+	EVP_CIPHER_CTX* c = EVP_CIPHER_CTX_new();
+	int outl;
+	int ok = EVP_EncryptInit_ex(c, p->gcm, NULL, p->key, p->iv)
+		&& (len==0 || EVP_EncryptUpdate(c, NULL, &outl, aad, (int)len))
+		&& EVP_EncryptFinal_ex(c, tag, &outl)
+		&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_GET_TAG, 16, tag);
+	EVP_CIPHER_CTX_free(c);
+	return ok;
+}
+
+/* xh = xh*h^blocks(len) ^ GHASH(segment)*h, tag is GCM tag of segment as aad */
+static void openssl_gcm_append(cipher_parallel_t* p, const unsigned char* tag, size_t len)
+{
+	int i;
+	gf128_mul_pow(p->xh, p->h, (len+15)/16);
+	for (i=0; i<16; i++)
+		p->xh[i] ^= tag[i] ^ p->ek0[i];
+	gf128_add_length(p->xh, p->h, (lua_Number)len, 0);
+}
+
+static int openssl_cipher_parallel_init(cipher_parallel_t* p, const EVP_CIPHER* cipher,
+	const unsigned char* key, const unsigned char* iv, const unsigned char* aad, size_t aad_len)
+{
+	memset(p, 0, sizeof(cipher_parallel_t));
+	p->key = key;
+	p->iv = iv;
+	if (EVP_CIPHER_mode(cipher)==EVP_CIPH_CTR_MODE) {
+		p->ctr = cipher;
+		memcpy(p->counter, iv, 16);
+		return 1;
+	} else {
+		const EVP_CIPHER* ecb;
+		EVP_CIPHER_CTX* c;
+		unsigned char zero[16] = {0};
+		unsigned char tag[16];
+		int outl, ok;
+
+		switch (EVP_CIPHER_nid(cipher)) {
+			case NID_aes_128_gcm: p->ctr = EVP_aes_128_ctr(); ecb = EVP_aes_128_ecb(); break;
+			case NID_aes_192_gcm: p->ctr = EVP_aes_192_ctr(); ecb = EVP_aes_192_ecb(); break;
+			case NID_aes_256_gcm: p->ctr = EVP_aes_256_ctr(); ecb = EVP_aes_256_ecb(); break;
+			default: return 0;
+		}
+		p->gcm = cipher;
+		memcpy(p->counter, iv, 12);
+		p->counter[15] = 2;
+
+		c = EVP_CIPHER_CTX_new();
+		ok = c!=NULL && EVP_EncryptInit_ex(c, ecb, NULL, key, NULL)
+			&& EVP_EncryptUpdate(c, p->h, &outl, zero, 16);
+		EVP_CIPHER_CTX_free(c);
+		ok = ok && openssl_gcm_aad_tag(p, NULL, 0, p->ek0);
+		if (ok && aad_len) {
+			ok = openssl_gcm_aad_tag(p, aad, aad_len, tag);
+			openssl_gcm_append(p, tag, aad_len);
+			p->aad_len = (lua_Number)aad_len;
+		}
+		return ok;
+	}
+}
+
+/* encrypt len bytes of in to out on threads, len must be multiple of chunk except last call,
+   p->tags must have room for every chunk of len when GCM */
+static int openssl_cipher_parallel_run(cipher_parallel_t* p, int threads, const unsigned char* in,
+	unsigned char* out, size_t len)
+{
+	int jobs = (int)((len+p->chunk-1)/p->chunk);
+	int i;
+
+	p->in = in;
+	p->out = out;
+	p->len = len;
+	openssl_thread_run(threads, jobs, openssl_cipher_parallel_job, p);
+	if (p->gcm) {
+		for (i=0; !p->failed && i<jobs; i++) {
+			size_t off = (size_t)i*p->chunk;
+			openssl_gcm_append(p, p->tags+16*i, len-off < p->chunk ? len-off : p->chunk);
+		}
+	}
+	openssl_counter_add(p->counter, len/16);
+	p->data_len += (lua_Number)len;
+	return !p->failed;
+}
+
+/* final GCM tag when all data is done */
+static void openssl_cipher_parallel_tag(cipher_parallel_t* p, unsigned char* tag)
+{
+	int i;
+	/* GHASH(aad, data, length block) = xh ^ length block*h */
+	memcpy(tag, p->xh, 16);
+	gf128_add_length(tag, p->h, p->aad_len, p->data_len);
+	for (i=0; i<16; i++)
+		tag[i] ^= p->ek0[i];
+}
+
+typedef struct {
+	cipher_parallel_t* p;
+	int threads;
+	unsigned char* in;
+	unsigned char* out;
+	size_t fill;
+	size_t size;
+	FILE* fp;
+} cipher_parallel_file_t;
+
+static int openssl_cipher_parallel_flush(cipher_parallel_file_t* f)
+{
+	int ok = openssl_cipher_parallel_run(f->p, f->threads, f->in, f->out, f->fill)
+		&& fwrite(f->out, 1, f->fill, f->fp)==f->fill;
+	f->fill = 0;
+	return ok;
+}
+
+/* collect pieces of input file into a batch of threads*chunk bytes */
+static int openssl_cipher_parallel_feed(void* arg, const unsigned char* data, size_t len)
+{
+	cipher_parallel_file_t* f = (cipher_parallel_file_t*)arg;
+	while (len) {
+		size_t n = f->size-f->fill < len ? f->size-f->fill : len;
+		memcpy(f->in+f->fill, data, n);
+		f->fill += n;
+		data += n;
+		len -= n;
+		if (f->fill==f->size && !openssl_cipher_parallel_flush(f))
+			return 0;
+	}
 	return 1;
 }
 
+/*  evp_cipher:encrypt_parallel(string data, string key, string iv [,table opts])->string [,string]{{{1
+
+	encrypt data with CTR or AES-GCM mode on opts.threads threads (default 1), data is cut in
+	opts.chunk bytes (default 1MB). output is the same as encrypt in one pass, GCM return tag
+	too and take opts.aad. with opts.output data is path of input file, result is written to
+	file opts.output in batches of threads*chunk bytes and number of bytes is returned
+*/
+LUA_FUNCTION(openssl_evp_encrypt_parallel)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	size_t inl, key_len, iv_len, aad_len = 0, out_len;
+	const char* in = luaL_checklstring(L,2,&inl);
+	const char* key = luaL_checklstring(L,3,&key_len);
+	const char* iv = luaL_checklstring(L,4,&iv_len);
+	int threads = openssl_opt_threads(L,5);
+	lua_Number chunk = openssl_opt_number(L,5,"chunk",OPENSSL_PARALLEL_CHUNK);
+	const char* aad = openssl_opt_lstring(L,5,"aad",&aad_len);
+	const char* output = openssl_opt_lstring(L,5,"output",&out_len);
+	lua_Number total = output ? openssl_file_size(in) : (lua_Number)inl;
+	cipher_parallel_t p;
+	unsigned char tag[16];
+	size_t jobs;
+	int ok;
+
+	if (EVP_CIPHER_mode(cipher)==EVP_CIPH_GCM_MODE)
+		luaL_argcheck(L,iv_len==12,4,"GCM need 12 bytes iv");
+	else
+		luaL_argcheck(L,EVP_CIPHER_mode(cipher)==EVP_CIPH_CTR_MODE && iv_len==16,4,
+			"CTR need 16 bytes iv");
+	luaL_argcheck(L,key_len==(size_t)EVP_CIPHER_key_length(cipher),3,"wrong key length");
+	if (total<0)
+		luaL_error(L,"can not stat file(%s)",in);
+	if (!openssl_cipher_parallel_init(&p,cipher,(const unsigned char*)key,(const unsigned char*)iv,
+		(const unsigned char*)aad,aad_len))
+		luaL_error(L,"only CTR and AES-GCM can be parallel");
+	if (p.gcm && total>OPENSSL_GCM_MAX_LENGTH)
+		luaL_error(L,"data too long for GCM");
+	if (chunk<16 || chunk>INT_MAX)
+		luaL_error(L,"option chunk out of range");
+	p.chunk = (size_t)chunk/16*16;
+	/* a file is done in batches of threads chunks, a string in one batch */
+	if (output && p.chunk > (size_t)-1/threads)
+		luaL_error(L,"option chunk out of range");
+	jobs = output ? (size_t)threads : inl/p.chunk + (inl%p.chunk!=0);
+	if (jobs > INT_MAX/16)
+		luaL_error(L,"option chunk too small for data");
+	if (p.gcm && (p.tags = malloc(16*(jobs ? jobs : 1)))==NULL)
+		luaL_error(L,"out of memory");
+
+	if (output) {
+		cipher_parallel_file_t f;
+		f.p = &p;
+		f.threads = threads;
+		f.fill = 0;
+		f.size = p.chunk*threads;
+		f.fp = fopen(output,"wb");
+		f.in = f.fp ? malloc(f.size) : NULL;
+		f.out = f.in ? malloc(f.size) : NULL;
+		if (f.out==NULL) {
+			if (f.fp)
+				fclose(f.fp);
+			free(f.in);
+			free(p.tags);
+			if (f.fp==NULL)
+				luaL_error(L,"can not open file(%s)",output);
+			luaL_error(L,"out of memory");
+		}
+		ok = openssl_file_feed(in,0,-1,openssl_cipher_parallel_feed,&f)
+			&& (f.fill==0 || openssl_cipher_parallel_flush(&f));
+		ok = (fclose(f.fp)==0) && ok;
+		free(f.in);
+		free(f.out);
+		free(p.tags);
+		if (!ok)
+			luaL_error(L,"encrypt file(%s) to file(%s) failed",in,output);
+		lua_pushnumber(L,p.data_len);
+	} else {
+		unsigned char* out = malloc(inl ? inl : 1);
+		if (out==NULL) {
+			free(p.tags);
+			luaL_error(L,"out of memory");
+		}
+		ok = openssl_cipher_parallel_run(&p,threads,(const unsigned char*)in,out,inl);
+		if (ok)
+			lua_pushlstring(L,(const char*)out,inl);
+		free(out);
+		free(p.tags);
+		if (!ok)
+			luaL_error(L,"EVP_EncryptUpdate failed, please check openssl error");
+	}
+
+	if (p.gcm) {
+		openssl_cipher_parallel_tag(&p,tag);
+		lua_pushlstring(L,(const char*)tag,16);
+		return 2;
+	}
+	return 1;
+}
+/* }}} */
+#endif
+
+#ifdef OPENSSL_HAVE_AEAD
+/* one shot AEAD, arguments are data, key, iv, aad, then taglen when enc or tag when dec */
+static int openssl_aead_crypt(lua_State* L, int enc)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	size_t inl, key_len, iv_len, aad_len = 0, tag_len = OPENSSL_AEAD_TAG_LENGTH;
+	const char* in = luaL_checklstring(L,2,&inl);
+	const char* key = luaL_checklstring(L,3,&key_len);
+	const char* iv = luaL_checklstring(L,4,&iv_len);
+	const char* aad = luaL_optlstring(L,5,NULL,&aad_len);
+	const char* tag = NULL;
+	ENGINE* e = lua_isnoneornil(L,7) ? NULL : CHECK_OBJECT(7, ENGINE, "openssl.engine");
+	int ccm = EVP_CIPHER_mode(cipher)==EVP_CIPH_CCM_MODE;
+	unsigned char stack[LUAL_BUFFERSIZE];
+	unsigned char t[OPENSSL_AEAD_TAG_LENGTH];
+	unsigned char* out;
+	EVP_CIPHER_CTX* c;
+	int len, outl = 0, ret;
+
+	luaL_argcheck(L,openssl_cipher_is_aead(cipher),1,"AEAD cipher expected");
+	luaL_argcheck(L,key_len==(size_t)EVP_CIPHER_key_length(cipher),3,"wrong key length");
+	if (enc)
+		tag_len = (size_t)luaL_optinteger(L,6,OPENSSL_AEAD_TAG_LENGTH);
+	else
+		tag = luaL_checklstring(L,6,&tag_len);
+	luaL_argcheck(L,tag_len>=4 && tag_len<=OPENSSL_AEAD_TAG_LENGTH,6,"tag length out of range");
+
+	c = EVP_CIPHER_CTX_new();
+	out = OPENSSL_CIPHER_BUFFER(stack, inl);
+	ret = EVP_CipherInit_ex(c, cipher, e, NULL, NULL, enc)
+		&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, NULL)
+		&& (!ccm || EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_CCM_SET_TAG, (int)tag_len, (void*)tag))
+		&& EVP_CipherInit_ex(c, NULL, NULL, (const unsigned char*)key, (const unsigned char*)iv, enc)
+		&& (!ccm || EVP_CipherUpdate(c, NULL, &len, NULL, (int)inl))
+		&& (aad_len==0 || EVP_CipherUpdate(c, NULL, &len, (const unsigned char*)aad, (int)aad_len));
+	if (!ret) {
+		EVP_CIPHER_CTX_free(c);
+		if (out!=stack)
+			free(out);
+		luaL_error(L, "EVP_CipherInit_ex failed, please check openssl error");
+	}
+
+	ret = EVP_CipherUpdate(c, out, &len, (const unsigned char*)in, (int)inl);
+	outl = len;
+	if (ret && !enc && !ccm)
+		ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_SET_TAG, (int)tag_len, (void*)tag);
+	if (ret)
+		ret = EVP_CipherFinal_ex(c, out+outl, &len);
+	outl += len;
+	if (ret && enc)
+		ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_GET_TAG, (int)tag_len, t);
+	EVP_CIPHER_CTX_free(c);
+
+	if (ret) {
+		lua_pushlstring(L, (const char*)out, outl);
+		if (enc)
+			lua_pushlstring(L, (const char*)t, tag_len);
+	}
+	if (out!=stack)
+		free(out);
+	return ret ? (enc ? 2 : 1) : 0;
+}
+
+/*  evp_cipher:seal_aead(string data, string key, string iv [,string aad [,number taglen=16 [,openssl.engine engimp]]])->string,string{{{1
+
+	encrypt and authenticate in one pass, return cipher text and tag
+*/
+LUA_FUNCTION(openssl_evp_seal_aead)
+{
+	return openssl_aead_crypt(L,1);
+}
+/* }}} */
+
+/*  evp_cipher:open_aead(string data, string key, string iv, string aad|nil, string tag [,openssl.engine engimp])->string{{{1
+
+	decrypt and verify tag in one pass, return nil if authentication failed
+*/
+LUA_FUNCTION(openssl_evp_open_aead)
+{
+	return openssl_aead_crypt(L,0);
+}
+/* }}} */
+#endif
+
 static luaL_Reg cipher_funs[] = {
 	{"info",			openssl_cipher_info},
 	{"encrypt_init",	openssl_evp_encrypt_init},
@@ -380,6 +1618,19 @@ static luaL_Reg cipher_funs[] = {
 
 	{"encrypt",			openssl_evp_encrypt },
 	{"decrypt",			openssl_evp_decrypt },
+	{"encrypt_many",	openssl_evp_encrypt_many },
+	{"decrypt_many",	openssl_evp_decrypt_many },
+	{"encrypt_file",	openssl_evp_encrypt_file },
+	{"decrypt_file",	openssl_evp_decrypt_file },
+#ifdef EVP_CIPH_XTS_MODE
+	{"xts_sectors",		openssl_evp_xts_sectors },
+#endif
+#ifdef OPENSSL_HAVE_AEAD
+	{"seal_aead",		openssl_evp_seal_aead },
+	{"open_aead",		openssl_evp_open_aead },
+	{"encrypt_parallel",	openssl_evp_encrypt_parallel },
+	{"seal_container",	openssl_container_seal },
+#endif
 
 	{"__tostring",		openssl_cipher_tostring},
 
@@ -397,6 +1648,24 @@ static luaL_Reg cipher_ctx_funs[] = {
 
 	{"info",		openssl_cipher_ctx_info},
 	{"cleanup",		openssl_cipher_ctx_cleanup},
+	{"reset",		openssl_cipher_ctx_reset},
+	{"seek",		openssl_cipher_ctx_seek},
+#ifdef EVP_CTRL_AEAD_TLS1_AAD
+	{"set_mac_key",	openssl_cipher_ctx_set_mac_key},
+	{"tls_record",	openssl_cipher_ctx_tls_record},
+	{"tls_records",	openssl_cipher_ctx_tls_records},
+#ifdef EVP_CTRL_TLS1_1_MULTIBLOCK_AAD
+	{"tls_multiblock",	openssl_cipher_ctx_tls_multiblock},
+#endif
+#endif
+	{"update_into",	openssl_cipher_ctx_update_into},
+	{"final_into",	openssl_cipher_ctx_final_into},
+#ifdef OPENSSL_HAVE_AEAD
+	{"set_iv_length",	openssl_cipher_ctx_set_iv_length},
+	{"set_aad",		openssl_cipher_ctx_set_aad},
+	{"set_tag",		openssl_cipher_ctx_set_tag},
+	{"get_tag",		openssl_cipher_ctx_get_tag},
+#endif
 	{"__gc",		openssl_cipher_ctx_free},
 	{"__tostring",		openssl_cipher_ctx_tostring},
 	{NULL, NULL}
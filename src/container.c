@@ -0,0 +1,481 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* container module for the Lua/OpenSSL binding.
+ *
+ * A container is data encrypted in chunks with an AEAD cipher, every chunk has its own
+ * nonce and tag, so any range is read by decrypting only the chunks it touches.
+ *
+ * header is 32 bytes, all numbers big endian:
+ *   "LOC1", cipher nid(4), chunk size(4), plain size(8), nonce(12)
+ * chunk i is at 32+i*(chunk size+16), cipher text followed by 16 bytes tag. Its nonce is
+ * header nonce with last 8 bytes xor i, header is AAD of every chunk. There is always at
+ * least one chunk, the last one may be short or empty.
+ * evp_cipher:seal_container()
+ * openssl.container_open()
+ * container:read()
+ */
+
+#ifdef OPENSSL_HAVE_AEAD
+
+#define CONTAINER_MAGIC		"LOC1"
+#define CONTAINER_HEADER	32
+#define CONTAINER_TAG		16
+#define CONTAINER_NONCE		12
+#define CONTAINER_CHUNK		(64*1024)
+
+typedef struct {
+	const EVP_CIPHER* cipher;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	unsigned char header[CONTAINER_HEADER];
+	size_t chunk;
+	lua_Number size;		/* bytes of plain text */
+	lua_Number chunks;		/* number of chunks */
+	int threads;
+	const unsigned char* data;	/* container in memory, the string is kept in fenv */
+	FILE* fp;				/* or container file */
+} container_t;
+
+static void container_put32(unsigned char* p, unsigned long v)
+{
+	int i;
+	for (i=3; i>=0; i--, v>>=8)
+		p[i] = (unsigned char)v;
+}
+
+static unsigned long container_get32(const unsigned char* p)
+{
+	return ((unsigned long)p[0]<<24) | ((unsigned long)p[1]<<16) | ((unsigned long)p[2]<<8) | p[3];
+}
+
+static lua_Number container_chunks(lua_Number size, size_t chunk)
+{
+	return size>0 ? ceil(size/chunk) : 1;
+}
+
+/* bytes of plain text in chunk idx */
+static size_t container_plain_len(const container_t* c, lua_Number idx)
+{
+	lua_Number left = c->size - idx*c->chunk;
+	return left < (lua_Number)c->chunk ? (size_t)left : c->chunk;
+}
+
+/* offset of chunk idx in container */
+static lua_Number container_offset(const container_t* c, lua_Number idx)
+{
+	return CONTAINER_HEADER + idx*(c->chunk+CONTAINER_TAG);
+}
+
+static int container_crypt_chunk(const container_t* c, int enc, lua_Number idx,
+	const unsigned char* in, size_t inl, unsigned char* out)
+{
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	unsigned char nonce[CONTAINER_NONCE];
+	unsigned long long n = (unsigned long long)idx;
+	int i, l1, l2, ok;
+
+	memcpy(nonce, c->header+CONTAINER_HEADER-CONTAINER_NONCE, CONTAINER_NONCE);
+	for (i=CONTAINER_NONCE-1; i>=CONTAINER_NONCE-8; i--, n>>=8)
+		nonce[i] ^= (unsigned char)n;
+
+	ok = EVP_CipherInit_ex(ctx, c->cipher, NULL, c->key, nonce, enc)
+		&& EVP_CipherUpdate(ctx, NULL, &l1, c->header, CONTAINER_HEADER)
+		&& EVP_CipherUpdate(ctx, out, &l1, in, (int)inl)
+		&& (enc || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CONTAINER_TAG, (void*)(in+inl)))
+		&& EVP_CipherFinal_ex(ctx, out+l1, &l2)
+		&& (!enc || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CONTAINER_TAG, out+inl));
+	EVP_CIPHER_CTX_free(ctx);
+	return ok;
+}
+
+/* consecutive chunks from first, plain text is packed, cipher text has tag after every chunk */
+typedef struct {
+	const container_t* c;
+	int enc;
+	lua_Number first;
+	const unsigned char* in;
+	unsigned char* out;
+	int failed;
+} container_batch_t;
+
+static void container_batch_job(void* arg, int j)
+{
+	container_batch_t* b = (container_batch_t*)arg;
+	size_t len = container_plain_len(b->c, b->first+j);
+	size_t plain = (size_t)j*b->c->chunk;
+	size_t sealed = (size_t)j*(b->c->chunk+CONTAINER_TAG);
+	int ok = b->enc
+		? container_crypt_chunk(b->c, 1, b->first+j, b->in+plain, len, b->out+sealed)
+		: container_crypt_chunk(b->c, 0, b->first+j, b->in+sealed, len, b->out+plain);
+	if (!ok)
+		b->failed = 1;
+}
+
+static int container_batch(const container_t* c, int enc, lua_Number first, int n,
+	const unsigned char* in, unsigned char* out)
+{
+	container_batch_t b;
+	b.c = c;
+	b.enc = enc;
+	b.first = first;
+	b.in = in;
+	b.out = out;
+	b.failed = 0;
+	openssl_thread_run(c->threads, n, container_batch_job, &b);
+	return !b.failed;
+}
+
+static void container_make_header(container_t* c, const unsigned char* nonce)
+{
+	unsigned char* h = c->header;
+	lua_Number size = c->size;
+	int i;
+
+	memcpy(h, CONTAINER_MAGIC, 4);
+	container_put32(h+4, (unsigned long)EVP_CIPHER_nid(c->cipher));
+	container_put32(h+8, (unsigned long)c->chunk);
+	for (i=19; i>=12; i--) {
+		lua_Number q = floor(size/256);
+		h[i] = (unsigned char)(size - q*256);
+		size = q;
+	}
+	memcpy(h+CONTAINER_HEADER-CONTAINER_NONCE, nonce, CONTAINER_NONCE);
+}
+
+static int container_parse_header(container_t* c)
+{
+	const unsigned char* h = c->header;
+	int i;
+
+	if (memcmp(h, CONTAINER_MAGIC, 4)!=0)
+		return 0;
+	c->cipher = EVP_get_cipherbynid((int)container_get32(h+4));
+	c->chunk = (size_t)container_get32(h+8);
+	c->size = 0;
+	for (i=12; i<20; i++)
+		c->size = c->size*256 + h[i];
+	if (c->cipher==NULL || c->chunk==0 || c->chunk>INT_MAX-CONTAINER_TAG)
+		return 0;
+	c->chunks = container_chunks(c->size, c->chunk);
+	return 1;
+}
+
+static void container_check_cipher(lua_State* L, const EVP_CIPHER* cipher, size_t key_len, int arg)
+{
+	if (!openssl_cipher_is_aead(cipher) || EVP_CIPHER_mode(cipher)==EVP_CIPH_CCM_MODE
+		|| EVP_CIPHER_iv_length(cipher)!=CONTAINER_NONCE)
+		luaL_error(L, "container need AEAD cipher with 12 bytes nonce, like aes-256-gcm or chacha20-poly1305");
+	luaL_argcheck(L, key_len==(size_t)EVP_CIPHER_key_length(cipher), arg, "wrong key length");
+}
+
+typedef struct {
+	container_t* c;
+	lua_Number next;		/* index of next chunk to seal */
+	lua_Number fed;			/* bytes of input so far */
+	unsigned char* in;
+	unsigned char* out;
+	size_t fill;
+	size_t size;
+	FILE* fp;
+} container_writer_t;
+
+static int container_writer_flush(container_writer_t* w)
+{
+	int n = w->fill ? (int)((w->fill+w->c->chunk-1)/w->c->chunk) : 1;
+	size_t outl = w->fill + (size_t)n*CONTAINER_TAG;
+	int ok = container_batch(w->c, 1, w->next, n, w->in, w->out)
+		&& fwrite(w->out, 1, outl, w->fp)==outl;
+	w->next += n;
+	w->fill = 0;
+	return ok;
+}
+
+static int container_writer_feed(void* arg, const unsigned char* data, size_t len)
+{
+	container_writer_t* w = (container_writer_t*)arg;
+	/* file changed since its size is put in header */
+	w->fed += len;
+	if (w->fed > w->c->size)
+		return 0;
+	while (len) {
+		size_t n = w->size-w->fill < len ? w->size-w->fill : len;
+		memcpy(w->in+w->fill, data, n);
+		w->fill += n;
+		data += n;
+		len -= n;
+		if (w->fill==w->size && !container_writer_flush(w))
+			return 0;
+	}
+	return 1;
+}
+
+/*  evp_cipher:seal_container(string data, string key [,table opts])->string{{{1
+
+	make a container of data. opts.chunk is bytes of plain text of every chunk, default 65536,
+	opts.nonce is 12 bytes, default random, opts.threads default 1. with opts.output data is
+	path of input file, container is written to file opts.output and its size is returned
+*/
+LUA_FUNCTION(openssl_container_seal)
+{
+	EVP_CIPHER* cipher = CHECK_OBJECT(1,EVP_CIPHER, "openssl.evp_cipher");
+	size_t inl, key_len, nonce_len = 0, out_len;
+	const char* in = luaL_checklstring(L, 2, &inl);
+	const char* key = luaL_checklstring(L, 3, &key_len);
+	lua_Number chunk = openssl_opt_number(L, 4, "chunk", CONTAINER_CHUNK);
+	const char* nonce = openssl_opt_lstring(L, 4, "nonce", &nonce_len);
+	const char* output = openssl_opt_lstring(L, 4, "output", &out_len);
+	unsigned char rnd[CONTAINER_NONCE];
+	container_t c;
+	int ok;
+
+	container_check_cipher(L, cipher, key_len, 3);
+	luaL_argcheck(L, chunk>=1 && chunk<=INT_MAX/2, 4, "chunk out of range");
+	luaL_argcheck(L, nonce==NULL || nonce_len==CONTAINER_NONCE, 4, "nonce must be 12 bytes");
+	if (nonce==NULL) {
+		if (RAND_bytes(rnd, CONTAINER_NONCE)!=1)
+			luaL_error(L, "RAND_bytes failed, please check openssl error");
+		nonce = (const char*)rnd;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.cipher = cipher;
+	memcpy(c.key, key, key_len);
+	c.chunk = (size_t)chunk;
+	c.threads = openssl_opt_threads(L, 4);
+	c.size = output ? openssl_file_size(in) : (lua_Number)inl;
+	if (c.size<0)
+		luaL_error(L, "can not stat file(%s)", in);
+	c.chunks = container_chunks(c.size, c.chunk);
+	container_make_header(&c, (const unsigned char*)nonce);
+
+	if (output) {
+		container_writer_t w;
+		w.c = &c;
+		w.next = 0;
+		w.fed = 0;
+		w.fill = 0;
+		w.size = c.chunk*(c.threads>1 ? c.threads : 1);
+		w.fp = fopen(output, "wb");
+		if (w.fp==NULL)
+			luaL_error(L, "can not open file(%s)", output);
+		w.in = malloc(w.size);
+		w.out = malloc(w.size + (w.size/c.chunk)*CONTAINER_TAG);
+		ok = fwrite(c.header, 1, CONTAINER_HEADER, w.fp)==CONTAINER_HEADER
+			&& openssl_file_feed(in, 0, -1, container_writer_feed, &w)
+			&& w.fed==c.size
+			&& (w.next==c.chunks || container_writer_flush(&w))
+			&& w.next==c.chunks;
+		ok = (fclose(w.fp)==0) && ok;
+		free(w.in);
+		free(w.out);
+		OPENSSL_cleanse(c.key, sizeof(c.key));
+		if (!ok) {
+			remove(output);
+			luaL_error(L, "seal file(%s) to container(%s) failed", in, output);
+		}
+		lua_pushnumber(L, container_offset(&c, c.chunks-1) + container_plain_len(&c, c.chunks-1) + CONTAINER_TAG);
+	} else {
+		size_t total = CONTAINER_HEADER + inl + (size_t)c.chunks*CONTAINER_TAG;
+		unsigned char* out = malloc(total);
+		memcpy(out, c.header, CONTAINER_HEADER);
+		ok = container_batch(&c, 1, 0, (int)c.chunks, (const unsigned char*)in, out+CONTAINER_HEADER);
+		OPENSSL_cleanse(c.key, sizeof(c.key));
+		if (ok)
+			lua_pushlstring(L, (const char*)out, total);
+		free(out);
+		if (!ok)
+			luaL_error(L, "EVP_CipherUpdate failed, please check openssl error");
+	}
+	return 1;
+}
+/* }}} */
+
+/* read sealed bytes of chunks first to first+n-1 */
+static unsigned char* container_load(container_t* c, lua_Number first, int n, size_t* len, int* owned)
+{
+	lua_Number last = first+n-1;
+	lua_Number off = container_offset(c, first);
+	unsigned char* buf;
+
+	*len = (size_t)(container_offset(c, last) + container_plain_len(c, last) + CONTAINER_TAG - off);
+	*owned = 0;
+	if (c->data)
+		return (unsigned char*)c->data + (size_t)off;
+	buf = malloc(*len);
+	if (!openssl_file_read_at(c->fp, off, buf, *len)) {
+		free(buf);
+		return NULL;
+	}
+	*owned = 1;
+	return buf;
+}
+
+/* decrypt chunks first to first+n-1 into out */
+static int container_open_chunks(container_t* c, lua_Number first, int n, unsigned char* out)
+{
+	size_t len;
+	int owned, ok;
+	unsigned char* in = container_load(c, first, n, &len, &owned);
+	if (in==NULL)
+		return 0;
+	ok = container_batch(c, 0, first, n, in, out);
+	if (owned)
+		free(in);
+	return ok;
+}
+
+/*  openssl.container_open(string src, string key [,table opts])=>openssl.container{{{1
+
+	src is container made by seal_container, or path of container file if opts.file is
+	true. opts.threads is number of threads to decrypt chunks, default 1. last chunk is
+	checked on open, so a truncated or modified header is found at once
+*/
+LUA_FUNCTION(openssl_container_open)
+{
+	size_t srcl, key_len;
+	const char* src = luaL_checklstring(L, 1, &srcl);
+	const char* key = luaL_checklstring(L, 2, &key_len);
+	int file = 0;
+	lua_Number total;
+	unsigned char* last;
+	container_t* c;
+	int ok;
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "file");
+		file = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	c = malloc(sizeof(container_t));
+	memset(c, 0, sizeof(container_t));
+	c->threads = openssl_opt_threads(L, 3);
+	PUSH_OBJECT(c, "openssl.container");
+
+	if (file) {
+		total = openssl_file_size(src);
+		c->fp = fopen(src, "rb");
+		if (c->fp==NULL)
+			luaL_error(L, "can not open file(%s)", src);
+		ok = total>=CONTAINER_HEADER && openssl_file_read_at(c->fp, 0, c->header, CONTAINER_HEADER);
+	} else {
+		/* keep src alive as long as the container */
+		lua_newtable(L);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		lua_setfenv(L, -2);
+		c->data = (const unsigned char*)src;
+		total = (lua_Number)srcl;
+		ok = srcl>=CONTAINER_HEADER;
+		if (ok)
+			memcpy(c->header, src, CONTAINER_HEADER);
+	}
+	if (!ok || !container_parse_header(c))
+		luaL_error(L, "#1 is not a container");
+	container_check_cipher(L, c->cipher, key_len, 2);
+	memcpy(c->key, key, key_len);
+	if (total != container_offset(c, c->chunks-1) + container_plain_len(c, c->chunks-1) + CONTAINER_TAG)
+		luaL_error(L, "#1 container is truncated or has extra data");
+
+	last = malloc(c->chunk ? c->chunk : 1);
+	ok = container_open_chunks(c, c->chunks-1, 1, last);
+	free(last);
+	if (!ok)
+		luaL_error(L, "#1 container authentication failed, wrong key or modified data");
+	return 1;
+}
+/* }}} */
+
+/*  container:read([number offset=0 [,number len]])->string{{{1
+
+	return len bytes of plain text from offset, default to end. only chunks in the range
+	are decrypted, on opts.threads threads. return nil if a chunk is not authentic
+*/
+LUA_FUNCTION(openssl_container_read)
+{
+	container_t* c = CHECK_OBJECT(1, container_t, "openssl.container");
+	lua_Number offset = luaL_optnumber(L, 2, 0);
+	lua_Number len = luaL_optnumber(L, 3, c->size - offset);
+	lua_Number first;
+	unsigned char* out;
+	int n, ok;
+
+	luaL_argcheck(L, offset>=0 && offset==floor(offset), 2, "offset must be integer not less than 0");
+	if (offset>=c->size || len<=0) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	if (offset+len > c->size)
+		len = c->size-offset;
+
+	first = floor(offset/c->chunk);
+	n = (int)(floor((offset+len-1)/c->chunk) - first + 1);
+	out = malloc((size_t)n*c->chunk);
+	ok = container_open_chunks(c, first, n, out);
+	if (ok)
+		lua_pushlstring(L, (const char*)out + (size_t)(offset - first*c->chunk), (size_t)len);
+	free(out);
+	return ok ? 1 : 0;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_container_size)
+{
+	container_t* c = CHECK_OBJECT(1, container_t, "openssl.container");
+	lua_pushnumber(L, c->size);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_container_info)
+{
+	container_t* c = CHECK_OBJECT(1, container_t, "openssl.container");
+	lua_newtable(L);
+	lua_pushnumber(L, c->size);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, c->chunks);
+	lua_setfield(L, -2, "chunks");
+	add_assoc_int(L, "chunk_size", (int)c->chunk);
+	openssl_method_push(L, c->cipher, OBJ_NAME_TYPE_CIPHER_METH);
+	lua_setfield(L, -2, "cipher");
+	return 1;
+}
+
+LUA_FUNCTION(openssl_container_tostring)
+{
+	container_t* c = CHECK_OBJECT(1, container_t, "openssl.container");
+	lua_pushfstring(L, "openssl.container:%p", c);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_container_gc)
+{
+	container_t* c = CHECK_OBJECT(1, container_t, "openssl.container");
+	if (c->fp)
+		fclose(c->fp);
+	OPENSSL_cleanse(c->key, sizeof(c->key));
+	free(c);
+	return 0;
+}
+
+static luaL_Reg container_funs[] = {
+	{"read",		openssl_container_read},
+	{"size",		openssl_container_size},
+	{"info",		openssl_container_info},
+
+	{"__tostring",	openssl_container_tostring},
+	{"__gc",		openssl_container_gc},
+	{NULL, NULL}
+};
+
+int openssl_register_container(lua_State* L)
+{
+	auxiliar_newclass(L, "openssl.container", container_funs);
+	return 0;
+}
+
+#endif
@@ -563,12 +563,9 @@ LUA_FUNCTION(openssl_csr_sign)
 	/* Now sign it */
 	{
 		const EVP_MD* md = NULL;
-		if (lua_isuserdata(L,digest)) {
-			md = CHECK_OBJECT(digest,EVP_MD,"openssl.evp_digest");
-		}
-		else if(lua_isstring(L,digest)) {
-			md = EVP_get_digestbyname(luaL_checkstring(L,digest));
-			if(!md) luaL_error(L,"EVP_get_digestbyname(%s) failed",luaL_checkstring(L,digest));
+		if (digest) {
+			md = GET_DIGEST(digest);
+			if(!md) luaL_error(L,"#%d unknown digest method",digest);
 		}else
 			md = EVP_get_digestbyname("sha1WithRSAEncryption");
 
@@ -641,12 +638,9 @@ LUA_FUNCTION(openssl_csr_new)
 
 	if (openssl_make_REQ(L, csr, pkey, dn, attribs, extentions) == 0) {
 		const EVP_MD* md = NULL;
-		if (lua_isuserdata(L,digest)) {
-			md = CHECK_OBJECT(digest,EVP_MD,"openssl.evp_digest");
-		}
-		else if(lua_isstring(L,digest)) {
-			md = EVP_get_digestbyname(luaL_checkstring(L,digest));
-			if(!md) luaL_error(L,"EVP_get_digestbyname(%s) failed",luaL_checkstring(L,digest));
+		if (digest) {
+			md = GET_DIGEST(digest);
+			if(!md) luaL_error(L,"#%d unknown digest method",digest);
 		}else
 			md = EVP_get_digestbyname("sha1WithRSAEncryption");
 
@@ -4,6 +4,8 @@ $Revision:$
 */
 
 #include "openssl.h"
+#include <openssl/md5.h>
+#include <openssl/sha.h>
 
 /* digest module for the Lua/OpenSSL binding.
  *
@@ -14,8 +16,9 @@ $Revision:$
 
 /* openssl.get_digest([nil,bool aliases=true]|string alg|int alg_id|openssl.asn1_obj|alg_obj) -> table|openssl.evp_digest|null  {{{1
 
-    openssl.get_digest([bool alias=true]) will return all md methods default with alias
-	other will return a md method
+    openssl.get_digest([bool alias=true]) will return all md methods default with alias,
+	the list is built once and shared, do not change it.
+	other will return a md method, the same userdata every time for one method
 */ 
 
 LUA_FUNCTION(openssl_get_digest) {
@@ -25,24 +28,13 @@ LUA_FUNCTION(openssl_get_digest) {
 	{
 		int aliases = lua_isnoneornil(L,1)?1:lua_toboolean(L,1);
 
-		lua_newtable(L);
-		OBJ_NAME_do_all_sorted(OBJ_NAME_TYPE_MD_METH, aliases ? openssl_add_method_or_alias: openssl_add_method, L);
+		openssl_method_list(L, OBJ_NAME_TYPE_MD_METH, aliases);
 		return 1;
 	}
 
-	if (lua_isstring(L,1))
-		md = EVP_get_digestbyname(lua_tostring(L,1));
-	else if(lua_isnumber(L,1))
-		md = EVP_get_digestbynid(lua_tointeger(L,1));
-	else if(auxiliar_isclass(L,"openssl.obj",1))
-		md = EVP_get_digestbyobj(CHECK_OBJECT(1,ASN1_OBJECT,"openssl.asn1_object"));
-	else
-	{
-		luaL_typerror(L,1,"please input correct paramater");
-	}
-
+	md = GET_DIGEST(1);
 	if(md)
-		PUSH_OBJECT((void*)md,"openssl.evp_digest");
+		openssl_method_push(L, md, OBJ_NAME_TYPE_MD_METH);
 	else
 		lua_pushnil(L);
 	return 1;	
@@ -63,23 +55,295 @@ LUA_FUNCTION(openssl_digest_info)
 	return 1;
 }
 
+/*  evp_digest:digest(string in [,string format='raw' [,openssl.engine engimp]])->string{{{1
+
+	format can be raw, hex, base64 or base64url, engimp may also be given in place of
+	format as before format was added
+*/
 LUA_FUNCTION(openssl_digest_digest)
 {
 	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
 	int inl;
 	const char* in = luaL_checklstring(L,2,&inl);
-	ENGINE*     e = lua_gettop(L)>2?CHECK_OBJECT(3,ENGINE,"openssl.engine"):NULL;
+	ENGINE*     e;
+	int format = openssl_get_format_engine(L,3,&e);
 
 	char buf[MAX_PATH];
 	int  blen = MAX_PATH;
 
 	int status = EVP_Digest(in, inl, buf, &blen, md, e); 
 	if (status) {
-		lua_pushlstring(L,buf,blen);
+		openssl_push_format(L,(const unsigned char*)buf,blen,format);
 	}else
 		lua_pushnil(L);
 	return 1;
 }
+/* }}} */
+
+/*  evp_digest:digest_many(table msgs [,bool concat=false [,openssl.engine engimp]])->table|string{{{1
+
+	hash every string of array msgs with one EVP_MD_CTX, return an array of digests,
+	or one string with all digests packed in order when concat is true
+*/
+LUA_FUNCTION(openssl_digest_digest_many)
+{
+	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	int concat = lua_toboolean(L,3);
+	ENGINE*     e = lua_gettop(L)>3?CHECK_OBJECT(4,ENGINE,"openssl.engine"):NULL;
+	int n, i;
+	EVP_MD_CTX* ctx;
+	luaL_Buffer B;
+
+	luaL_checktype(L,2,LUA_TTABLE);
+	n = lua_objlen(L,2);
+
+	if (concat)
+		luaL_buffinit(L,&B);
+	else
+		lua_createtable(L,n,0);
+
+	ctx = EVP_MD_CTX_create();
+	for (i=1; i<=n; i++)
+	{
+		size_t inl;
+		const char* in;
+		unsigned char buf[EVP_MAX_MD_SIZE];
+		unsigned int blen = EVP_MAX_MD_SIZE;
+
+		lua_rawgeti(L,2,i);
+		in = lua_tolstring(L,-1,&inl);
+		if (in==NULL) {
+			EVP_MD_CTX_destroy(ctx);
+			luaL_error(L,"#2 item %d must be string",i);
+		}
+
+		if (!EVP_DigestInit_ex(ctx,md,e)
+			|| !EVP_DigestUpdate(ctx,in,inl)
+			|| !EVP_DigestFinal_ex(ctx,buf,&blen))
+		{
+			EVP_MD_CTX_destroy(ctx);
+			luaL_error(L,"digest failed at item %d",i);
+		}
+		lua_pop(L,1);
+
+		if (concat)
+			luaL_addlstring(&B,(const char*)buf,blen);
+		else {
+			lua_pushlstring(L,(const char*)buf,blen);
+			lua_rawseti(L,-2,i);
+		}
+	}
+	EVP_MD_CTX_destroy(ctx);
+
+	if (concat)
+		luaL_pushresult(&B);
+	return 1;
+}
+/* }}} */
+
+static int openssl_digest_feed(void* arg, const unsigned char* data, size_t len)
+{
+	return EVP_DigestUpdate((EVP_MD_CTX*)arg, data, len);
+}
+
+/*  evp_digest:digest_file(string path [,number offset=0 [,number length=-1 [,openssl.engine engimp]]])->string{{{1
+
+	hash length bytes of file path from offset, read to end of file when length is negative,
+	file data is mapped or read directly into EVP_DigestUpdate without Lua strings
+*/
+LUA_FUNCTION(openssl_digest_digest_file)
+{
+	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	const char* path = luaL_checkstring(L,2);
+	lua_Number offset = luaL_optnumber(L,3,0);
+	lua_Number length = luaL_optnumber(L,4,-1);
+	ENGINE*     e = lua_gettop(L)>4?CHECK_OBJECT(5,ENGINE,"openssl.engine"):NULL;
+
+	unsigned char buf[EVP_MAX_MD_SIZE];
+	unsigned int blen = EVP_MAX_MD_SIZE;
+	int ret;
+	EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+
+	ret = EVP_DigestInit_ex(ctx,md,e)
+		&& openssl_file_feed(path, offset, length, openssl_digest_feed, ctx)
+		&& EVP_DigestFinal_ex(ctx,buf,&blen);
+	EVP_MD_CTX_destroy(ctx);
+
+	if (!ret)
+		luaL_error(L,"digest file(%s) failed", path);
+	lua_pushlstring(L,(const char*)buf,blen);
+	return 1;
+}
+/* }}} */
+
+/* {{{ Merkle tree digest
+   leaf hash is H(0x00 || leaf data), node hash is H(0x01 || left || right),
+   a node without sibling is moved up to next level unchanged */
+#define TREE_LEAF_SIZE	(1024*1024)
+
+typedef struct {
+	const EVP_MD* md;
+	const char* path;
+	const unsigned char* data;
+	lua_Number size;
+	lua_Number leaf_size;
+	unsigned char* leaves;
+	int failed;
+} tree_digest_t;
+
+static void tree_digest_leaf(void* arg, int i)
+{
+	tree_digest_t* t = (tree_digest_t*)arg;
+	lua_Number off = i * t->leaf_size;
+	lua_Number len = t->size - off < t->leaf_size ? t->size - off : t->leaf_size;
+	unsigned char prefix = 0;
+	EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+	int ok = EVP_DigestInit_ex(ctx,t->md,NULL) && EVP_DigestUpdate(ctx,&prefix,1);
+
+	if (ok && t->path)
+		ok = openssl_file_feed(t->path, off, len, openssl_digest_feed, ctx);
+	else if (ok)
+		ok = EVP_DigestUpdate(ctx, t->data + (size_t)off, (size_t)len);
+	ok = ok && EVP_DigestFinal_ex(ctx, t->leaves + i*EVP_MD_size(t->md), NULL);
+	EVP_MD_CTX_destroy(ctx);
+	if (!ok)
+		t->failed = 1;
+}
+
+/* combine n node hashes in nodes to root, nodes is overwritten */
+static int tree_digest_root(const EVP_MD* md, unsigned char* nodes, int n, unsigned char* root)
+{
+	int mdlen = EVP_MD_size(md);
+	unsigned char prefix = 1;
+	int i, ok = 1;
+	EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+
+	while (ok && n>1) {
+		for (i=0; ok && i<n/2; i++) {
+			unsigned char buf[EVP_MAX_MD_SIZE];
+			ok = EVP_DigestInit_ex(ctx,md,NULL)
+				&& EVP_DigestUpdate(ctx,&prefix,1)
+				&& EVP_DigestUpdate(ctx,nodes+2*i*mdlen,2*mdlen)
+				&& EVP_DigestFinal_ex(ctx,buf,NULL);
+			memcpy(nodes+i*mdlen,buf,mdlen);
+		}
+		if (n%2)
+			memmove(nodes+(n/2)*mdlen,nodes+(n-1)*mdlen,mdlen);
+		n = (n+1)/2;
+	}
+	EVP_MD_CTX_destroy(ctx);
+	memcpy(root,nodes,mdlen);
+	return ok;
+}
+
+/* hash leaves of data or file on a worker pool, push root and array of leaf hashes */
+static int tree_digest(lua_State* L, const EVP_MD* md, const char* path, const unsigned char* data, lua_Number size, int opts)
+{
+	tree_digest_t t;
+	int threads = openssl_opt_threads(L,opts);
+	lua_Number nleaves;
+	int mdlen = EVP_MD_size(md);
+	unsigned char root[EVP_MAX_MD_SIZE];
+	int i, n;
+
+	t.md = md;
+	t.path = path;
+	t.data = data;
+	t.size = size;
+	t.leaf_size = openssl_opt_number(L,opts,"leaf_size",TREE_LEAF_SIZE);
+	t.failed = 0;
+	if (t.leaf_size<1 || t.leaf_size!=floor(t.leaf_size))
+		luaL_error(L,"leaf_size must be positive integer");
+	nleaves = size>0 ? ceil(size/t.leaf_size) : 1;
+	if (nleaves>0x7fffffff/EVP_MAX_MD_SIZE)
+		luaL_error(L,"too many leaves, use larger leaf_size");
+	n = (int)nleaves;
+
+	t.leaves = malloc(n*mdlen);
+	openssl_thread_run(threads, n, tree_digest_leaf, &t);
+	if (t.failed) {
+		free(t.leaves);
+		luaL_error(L,"tree digest failed");
+	}
+
+	lua_createtable(L,n,0);
+	for (i=0; i<n; i++) {
+		lua_pushlstring(L,(const char*)t.leaves+i*mdlen,mdlen);
+		lua_rawseti(L,-2,i+1);
+	}
+	i = tree_digest_root(md,t.leaves,n,root);
+	free(t.leaves);
+	if (!i)
+		luaL_error(L,"tree digest failed");
+	lua_pushlstring(L,(const char*)root,mdlen);
+	lua_insert(L,-2);
+	return 2;
+}
+
+/*  evp_digest:tree_digest(string data [,table opts])->string root, table leaves{{{1
+
+	opts.leaf_size is bytes of each leaf, default 1048576, opts.threads is number
+	of threads hash leaves in parallel, default 1
+*/
+LUA_FUNCTION(openssl_digest_tree_digest)
+{
+	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	size_t len;
+	const char* data = luaL_checklstring(L,2,&len);
+	return tree_digest(L,md,NULL,(const unsigned char*)data,(lua_Number)len,3);
+}
+/* }}} */
+
+/*  evp_digest:tree_digest_file(string path [,table opts])->string root, table leaves{{{1
+*/
+LUA_FUNCTION(openssl_digest_tree_digest_file)
+{
+	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	const char* path = luaL_checkstring(L,2);
+	lua_Number size = openssl_file_size(path);
+	if (size<0)
+		luaL_error(L,"can not stat file(%s)",path);
+	return tree_digest(L,md,path,NULL,size,3);
+}
+/* }}} */
+
+/*  evp_digest:tree_root(table leaves)->string{{{1
+
+	compute root from leaf hashes, so after some leaves changed only them need hashing again
+*/
+LUA_FUNCTION(openssl_digest_tree_root)
+{
+	EVP_MD *md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	int mdlen = EVP_MD_size(md);
+	unsigned char root[EVP_MAX_MD_SIZE];
+	unsigned char* nodes;
+	int i, n, ok;
+
+	luaL_checktype(L,2,LUA_TTABLE);
+	n = lua_objlen(L,2);
+	luaL_argcheck(L,n>0,2,"leaves must not be empty");
+	nodes = malloc(n*mdlen);
+	for (i=0; i<n; i++) {
+		size_t l;
+		const char* h;
+		lua_rawgeti(L,2,i+1);
+		h = lua_tolstring(L,-1,&l);
+		if (h==NULL || l!=(size_t)mdlen) {
+			free(nodes);
+			luaL_error(L,"#2 item %d is not a %s hash",i+1,EVP_MD_name(md));
+		}
+		memcpy(nodes+i*mdlen,h,mdlen);
+		lua_pop(L,1);
+	}
+	ok = tree_digest_root(md,nodes,n,root);
+	free(nodes);
+	if (!ok)
+		luaL_error(L,"tree digest failed");
+	lua_pushlstring(L,(const char*)root,mdlen);
+	return 1;
+}
+/* }}} */
+/* }}} */
 
 LUA_FUNCTION(openssl_digest_tostring)
 {
@@ -107,33 +371,284 @@ LUA_FUNCTION(openssl_evp_digest_init)
 }
 /* }}} */
 
-/*  openssl.evp_digest_init(openssl.evp_digest_ctx ctx, string data)->bool{{{1
+/*  openssl.evp_digest_update(openssl.evp_digest_ctx ctx, string|number|table data, ...)->bool{{{1
+
+	every argument is fed in order, a table is an array of strings or numbers
 */ 
 LUA_FUNCTION(openssl_evp_digest_update)
 {
 	EVP_MD_CTX* c = CHECK_OBJECT(1,EVP_MD_CTX, "openssl.evp_digest_ctx");
-	int inl;
+	int ret;
 
-	const char* in= luaL_checklstring(L,2,&inl);
-	
-	int ret = EVP_DigestUpdate(c,in,inl);
+	luaL_checkany(L,2);
+	ret = openssl_feed_args(L,2,openssl_digest_feed,c);
 
 	lua_pushboolean(L,ret);
 	return 1;
 }
 /* }}} */
 
-/*  openssl.evp_digest_final(openssl.evp_digest_ctx ctx)->string{{{1
+/*  digest_ctx:update_file(string path [,number offset=0 [,number length=-1]])->bool{{{1
+*/
+LUA_FUNCTION(openssl_evp_digest_update_file)
+{
+	EVP_MD_CTX* c = CHECK_OBJECT(1,EVP_MD_CTX, "openssl.evp_digest_ctx");
+	const char* path = luaL_checkstring(L,2);
+	lua_Number offset = luaL_optnumber(L,3,0);
+	lua_Number length = luaL_optnumber(L,4,-1);
+
+	lua_pushboolean(L,openssl_file_feed(path, offset, length, openssl_digest_feed, c));
+	return 1;
+}
+/* }}} */
+
+/*  digest_ctx:clone()->openssl.evp_digest_ctx{{{1
+
+	return a new context with the same running state, data updated before clone is not hashed again
+*/
+LUA_FUNCTION(openssl_evp_digest_clone)
+{
+	EVP_MD_CTX* c = CHECK_OBJECT(1,EVP_MD_CTX, "openssl.evp_digest_ctx");
+	EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+	PUSH_OBJECT(ctx,"openssl.evp_digest_ctx");
+
+	if (!EVP_MD_CTX_copy_ex(ctx,c)) {
+		luaL_error(L,"EVP_MD_CTX_copy_ex failed");
+	}
+	return 1;
+}
+/* }}} */
+
+/* midstate blob is a 8 bytes header, nid and size of md_data both as big endian 32 bits
+   integer, followed by raw md_data of digest. */
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+/* state blob: nid and version as 4 bytes each, chaining values big endian, bit count as
+   16 bytes, number of buffered bytes as 4 bytes, then the buffered bytes */
+#define DIGEST_STATE_VERSION	1
+#define DIGEST_STATE_COUNT	16
+
+/* midstate of md5, sha1 and sha2 in a form independent of openssl build */
+typedef struct {
+	unsigned long long h[8];
+	int nh;					/* number of chaining values */
+	int wide;				/* chaining values and count are 64 bits */
+	unsigned long long hi, lo;	/* bit count */
+	unsigned char* data;	/* buffered bytes in ctx */
+	unsigned int* num;
+	unsigned int block;
+} digest_state_t;
+
+static void digest_state_put(unsigned char* p, unsigned long long v, int n)
+{
+	while (n-- > 0) {
+		p[n] = (unsigned char)v;
+		v >>= 8;
+	}
+}
+
+static unsigned long long digest_state_get(const unsigned char* p, int n)
+{
+	unsigned long long v = 0;
+	while (n-- > 0)
+		v = (v<<8) | *p++;
+	return v;
+}
+
+/* copy chaining values and bit count of d, an MD5_CTX, SHA_CTX, SHA256_CTX or
+   SHA512_CTX of nid, to s when store is 0, or from s to d. return 0 if nid is not
+   supported */
+static int digest_state_io(int nid, void* d, digest_state_t* s, int store)
+{
+	SHA_LONG* h32[8];
+	SHA_LONG *Nl = NULL, *Nh = NULL;
+	int i;
+
+	s->wide = 0;
+	s->block = 64;
+	switch (nid) {
+		case NID_md5:
+			{
+				MD5_CTX* c = (MD5_CTX*)d;
+				h32[0] = (SHA_LONG*)&c->A;
+				h32[1] = (SHA_LONG*)&c->B;
+				h32[2] = (SHA_LONG*)&c->C;
+				h32[3] = (SHA_LONG*)&c->D;
+				s->nh = 4;
+				Nl = (SHA_LONG*)&c->Nl;
+				Nh = (SHA_LONG*)&c->Nh;
+				s->data = (unsigned char*)c->data;
+				s->num = &c->num;
+			}
+			break;
+		case NID_sha1:
+			{
+				SHA_CTX* c = (SHA_CTX*)d;
+				h32[0] = &c->h0;
+				h32[1] = &c->h1;
+				h32[2] = &c->h2;
+				h32[3] = &c->h3;
+				h32[4] = &c->h4;
+				s->nh = 5;
+				Nl = &c->Nl;
+				Nh = &c->Nh;
+				s->data = (unsigned char*)c->data;
+				s->num = &c->num;
+			}
+			break;
+		case NID_sha224:
+		case NID_sha256:
+			{
+				SHA256_CTX* c = (SHA256_CTX*)d;
+				for (i=0; i<8; i++)
+					h32[i] = &c->h[i];
+				s->nh = 8;
+				Nl = &c->Nl;
+				Nh = &c->Nh;
+				s->data = (unsigned char*)c->data;
+				s->num = &c->num;
+			}
+			break;
+		case NID_sha384:
+		case NID_sha512:
+			{
+				SHA512_CTX* c = (SHA512_CTX*)d;
+				s->nh = 8;
+				s->wide = 1;
+				s->block = 128;
+				s->data = c->u.p;
+				s->num = &c->num;
+				for (i=0; i<8; i++) {
+					if (store)
+						c->h[i] = s->h[i];
+					else
+						s->h[i] = c->h[i];
+				}
+				if (store) {
+					c->Nl = s->lo;
+					c->Nh = s->hi;
+				} else {
+					s->lo = c->Nl;
+					s->hi = c->Nh;
+				}
+			}
+			return 1;
+		default:
+			return 0;
+	}
+
+	for (i=0; i<s->nh; i++) {
+		if (store)
+			*h32[i] = (SHA_LONG)s->h[i];
+		else
+			s->h[i] = *h32[i] & 0xffffffff;
+	}
+	if (store) {
+		*Nl = (SHA_LONG)(s->lo & 0xffffffff);
+		*Nh = (SHA_LONG)(s->lo >> 32);
+	} else {
+		s->lo = ((unsigned long long)(*Nh & 0xffffffff) << 32) | (*Nl & 0xffffffff);
+		s->hi = 0;
+	}
+	return 1;
+}
+
+/*  digest_ctx:export_state()->string{{{1
+
+	serialise midstate of a md5, sha1 or sha2 digest_ctx, chaining values, bit count and
+	buffered bytes are written in a fixed byte order, so the blob does not depend on
+	openssl build or machine. need openssl 1.0.0
+*/
+LUA_FUNCTION(openssl_evp_digest_export_state)
+{
+	EVP_MD_CTX* c = CHECK_OBJECT(1,EVP_MD_CTX, "openssl.evp_digest_ctx");
+	const EVP_MD* md = EVP_MD_CTX_md(c);
+	digest_state_t st;
+	luaL_Buffer B;
+	unsigned char* p;
+	int i, w;
+
+	if (md==NULL || c->engine!=NULL || c->md_data==NULL
+		|| !digest_state_io(EVP_MD_type(md), c->md_data, &st, 0))
+		luaL_error(L,"digest_ctx state can not be exported");
+
+	w = st.wide ? 8 : 4;
+	luaL_buffinit(L,&B);
+	p = (unsigned char*)luaL_prepbuffer(&B);
+	digest_state_put(p, EVP_MD_type(md), 4);
+	digest_state_put(p+4, DIGEST_STATE_VERSION, 4);
+	p += 8;
+	for (i=0; i<st.nh; i++, p+=w)
+		digest_state_put(p, st.h[i], w);
+	digest_state_put(p, st.hi, 8);
+	digest_state_put(p+8, st.lo, 8);
+	digest_state_put(p+DIGEST_STATE_COUNT, *st.num, 4);
+	luaL_addsize(&B, 8 + st.nh*w + DIGEST_STATE_COUNT + 4);
+	luaL_addlstring(&B, (const char*)st.data, *st.num);
+	luaL_pushresult(&B);
+	return 1;
+}
+/* }}} */
+
+/*  evp_digest:import_state(string state)->openssl.evp_digest_ctx{{{1
+
+	create a digest context resumed from a blob returned by digest_ctx:export_state(),
+	the blob is checked before any byte of it is used
+*/
+LUA_FUNCTION(openssl_digest_import_state)
+{
+	EVP_MD* md = CHECK_OBJECT(1,EVP_MD, "openssl.evp_digest");
+	size_t len, fixed;
+	const unsigned char* s = (const unsigned char*)luaL_checklstring(L,2,&len);
+	EVP_MD_CTX* ctx;
+	digest_state_t st;
+	unsigned int num;
+	int i, w;
+
+	ctx = EVP_MD_CTX_create();
+	PUSH_OBJECT(ctx,"openssl.evp_digest_ctx");
+	if (!EVP_DigestInit_ex(ctx,md,NULL) || ctx->md_data==NULL)
+		luaL_error(L,"EVP_DigestInit_ex failed");
+	if (!digest_state_io(EVP_MD_type(md), ctx->md_data, &st, 0))
+		luaL_error(L,"state of %s can not be imported", EVP_MD_name(md));
+
+	w = st.wide ? 8 : 4;
+	fixed = 8 + st.nh*w + DIGEST_STATE_COUNT + 4;
+	if (len<fixed
+		|| digest_state_get(s, 4)!=(unsigned long long)EVP_MD_type(md)
+		|| digest_state_get(s+4, 4)!=DIGEST_STATE_VERSION)
+		luaL_error(L,"#2 is not a valid state of %s", EVP_MD_name(md));
+	s += 8;
+	for (i=0; i<st.nh; i++, s+=w)
+		st.h[i] = digest_state_get(s, w);
+	st.hi = digest_state_get(s, 8);
+	st.lo = digest_state_get(s+8, 8);
+	num = (unsigned int)digest_state_get(s+DIGEST_STATE_COUNT, 4);
+	s += DIGEST_STATE_COUNT + 4;
+	/* buffered bytes must be less than a block and match the byte count */
+	if (num>=st.block || len!=fixed+num || (st.lo & 7)!=0
+		|| ((st.lo>>3) & (st.block-1))!=num || (!st.wide && st.hi!=0))
+		luaL_error(L,"#2 is not a valid state of %s", EVP_MD_name(md));
+
+	digest_state_io(EVP_MD_type(md), ctx->md_data, &st, 1);
+	memcpy(st.data, s, num);
+	*st.num = num;
+	return 1;
+}
+/* }}} */
+#endif
+
+/*  openssl.evp_digest_final(openssl.evp_digest_ctx ctx [,string format='raw'])->string{{{1
 */ 
 LUA_FUNCTION(openssl_evp_digest_final)
 {
 	EVP_MD_CTX* c = CHECK_OBJECT(1,EVP_MD_CTX, "openssl.evp_digest_ctx");
+	int format = openssl_get_format(L,2);
 	int outl = EVP_MAX_MD_SIZE;
 	char out[EVP_MAX_MD_SIZE];
 
 	if(EVP_DigestFinal_ex(c,out,&outl) && outl)
 	{
-		lua_pushlstring(L,out,outl);
+		openssl_push_format(L,(const unsigned char*)out,outl,format);
 		return 1;
 	}
 	return 0;
@@ -150,7 +665,7 @@ LUA_FUNCTION(openssl_digest_ctx_info)
 	add_assoc_int(L,"size", EVP_MD_CTX_size(ctx));
 	add_assoc_int(L,"type", EVP_MD_CTX_type(ctx));
 
-	PUSH_OBJECT((void*)EVP_MD_CTX_md(ctx),"openssl.evp_digest");
+	openssl_method_push(L,EVP_MD_CTX_md(ctx),OBJ_NAME_TYPE_MD_METH);
 	lua_setfield(L,-2,"digest");
 	return 1;
 }
@@ -177,6 +692,14 @@ LUA_FUNCTION(openssl_digest_ctx_cleanup) {
 static luaL_Reg digest_funs[] = {
 	{"info",			openssl_digest_info},
 	{"digest",			openssl_digest_digest},
+	{"digest_many",		openssl_digest_digest_many},
+	{"digest_file",		openssl_digest_digest_file},
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	{"import_state",	openssl_digest_import_state},
+#endif
+	{"tree_digest",		openssl_digest_tree_digest},
+	{"tree_digest_file",	openssl_digest_tree_digest_file},
+	{"tree_root",		openssl_digest_tree_root},
 	{"init",			openssl_evp_digest_init},
 
 	{"__tostring",		openssl_digest_tostring},
@@ -185,7 +708,12 @@ static luaL_Reg digest_funs[] = {
 
 static luaL_Reg digest_ctx_funs[] = {
 	{"update",			openssl_evp_digest_update},
+	{"update_file",		openssl_evp_digest_update_file},
 	{"final",			openssl_evp_digest_final},
+	{"clone",			openssl_evp_digest_clone},
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	{"export_state",	openssl_evp_digest_export_state},
+#endif
 
 	{"info",		openssl_digest_ctx_info},
 	{"__tostring",	openssl_digest_ctx_tostring},
@@ -0,0 +1,271 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* hmac module for the Lua/OpenSSL binding.
+ *
+ * An openssl.hmac object is keyed once, HMAC keeps the digest state after ipad and
+ * opad, every new mac restart from a copy of that state and never run the key schedule again.
+ * hmac_new()
+ * hmac:mac()
+ * hmac:init()
+ */
+
+static HMAC_CTX* openssl_hmac_ctx_new(lua_State* L)
+{
+	HMAC_CTX* ctx = malloc(sizeof(HMAC_CTX));
+	if (ctx==NULL)
+		luaL_error(L, "out of memory");
+	HMAC_CTX_init(ctx);
+	return ctx;
+}
+
+static void openssl_hmac_ctx_free(HMAC_CTX* ctx)
+{
+	HMAC_CTX_cleanup(ctx);
+	free(ctx);
+}
+
+/* HMAC functions return int since 1.0.0, void before */
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+#define HMAC_OK(call)		(call)
+#else
+#define HMAC_OK(call)		((call), 1)
+#endif
+
+/* restart ctx with the key it already has, copy of precomputed ipad state */
+#define HMAC_RESTART(ctx)	HMAC_OK(HMAC_Init_ex((ctx), NULL, 0, NULL, NULL))
+
+/* mac of in with the key of ctx into buf, return 0 if failed */
+static int openssl_hmac_once(HMAC_CTX* ctx, const char* in, size_t inl, unsigned char* buf, unsigned int* blen)
+{
+	return HMAC_RESTART(ctx)
+		&& HMAC_OK(HMAC_Update(ctx, (const unsigned char*)in, inl))
+		&& HMAC_OK(HMAC_Final(ctx, buf, blen));
+}
+
+/*  openssl.hmac_new(openssl.evp_digest md|string alg, string key [,openssl.engine engimp])->openssl.hmac{{{1
+*/
+LUA_FUNCTION(openssl_hmac_new)
+{
+	const EVP_MD* md = NULL;
+	size_t klen;
+	const char* key = luaL_checklstring(L,2,&klen);
+	ENGINE*     e = lua_gettop(L)>2?CHECK_OBJECT(3,ENGINE,"openssl.engine"):NULL;
+	HMAC_CTX* ctx;
+
+	md = GET_DIGEST(1);
+	if (!md)
+		luaL_error(L, "#1 unknown digest method");
+
+	ctx = openssl_hmac_ctx_new(L);
+	PUSH_OBJECT(ctx,"openssl.hmac");
+	if (!HMAC_OK(HMAC_Init_ex(ctx, key, klen, md, e)))
+		luaL_error(L,"HMAC_Init_ex failed");
+	return 1;
+}
+/* }}} */
+
+/*  hmac:mac(string data [,string format='raw'])->string{{{1
+
+	return nil if failed
+*/
+LUA_FUNCTION(openssl_hmac_mac)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	size_t inl;
+	const char* in = luaL_checklstring(L,2,&inl);
+	int format = openssl_get_format(L,3);
+	unsigned char buf[EVP_MAX_MD_SIZE];
+	unsigned int blen = EVP_MAX_MD_SIZE;
+
+	if (!openssl_hmac_once(ctx, in, inl, buf, &blen))
+		return 0;
+	openssl_push_format(L,buf,blen,format);
+	return 1;
+}
+/* }}} */
+
+/*  hmac:mac_many(table msgs [,bool concat=false])->table|string{{{1
+
+	mac every string of array msgs with the same key, return an array of macs,
+	or one string with all macs packed in order when concat is true. return nil and
+	index of the message failed
+*/
+LUA_FUNCTION(openssl_hmac_mac_many)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	int concat = lua_toboolean(L,3);
+	int n, i;
+	luaL_Buffer B;
+
+	luaL_checktype(L,2,LUA_TTABLE);
+	n = lua_objlen(L,2);
+
+	if (concat)
+		luaL_buffinit(L,&B);
+	else
+		lua_createtable(L,n,0);
+
+	for (i=1; i<=n; i++)
+	{
+		size_t inl;
+		const char* in;
+		unsigned char buf[EVP_MAX_MD_SIZE];
+		unsigned int blen = EVP_MAX_MD_SIZE;
+
+		lua_rawgeti(L,2,i);
+		in = lua_tolstring(L,-1,&inl);
+		if (in==NULL)
+			luaL_error(L,"#2 item %d must be string",i);
+
+		if (!openssl_hmac_once(ctx, in, inl, buf, &blen)) {
+			lua_pushnil(L);
+			lua_pushinteger(L,i);
+			return 2;
+		}
+		lua_pop(L,1);
+
+		if (concat)
+			luaL_addlstring(&B,(const char*)buf,blen);
+		else {
+			lua_pushlstring(L,(const char*)buf,blen);
+			lua_rawseti(L,-2,i);
+		}
+	}
+
+	if (concat)
+		luaL_pushresult(&B);
+	return 1;
+}
+/* }}} */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+/*  hmac:init()->openssl.hmac_ctx{{{1
+*/
+LUA_FUNCTION(openssl_hmac_init)
+{
+	HMAC_CTX* key = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	HMAC_CTX* ctx = openssl_hmac_ctx_new(L);
+
+	PUSH_OBJECT(ctx,"openssl.hmac_ctx");
+	if (!HMAC_CTX_copy(ctx, key) || !HMAC_RESTART(ctx))
+		luaL_error(L,"HMAC_CTX_copy failed");
+	return 1;
+}
+/* }}} */
+#endif
+
+LUA_FUNCTION(openssl_hmac_info)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	lua_newtable(L);
+	add_assoc_int(L,"size", EVP_MD_size(ctx->md));
+	openssl_method_push(L,ctx->md,OBJ_NAME_TYPE_MD_METH);
+	lua_setfield(L,-2,"digest");
+	return 1;
+}
+
+LUA_FUNCTION(openssl_hmac_tostring)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	lua_pushfstring(L,"openssl.hmac:%p",ctx);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_hmac_free)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac");
+	openssl_hmac_ctx_free(ctx);
+	return 0;
+}
+
+static int openssl_hmac_feed(void* arg, const unsigned char* data, size_t len)
+{
+	return HMAC_OK(HMAC_Update((HMAC_CTX*)arg, data, len));
+}
+
+/*  hmac_ctx:update(string data, ...)->bool{{{1
+
+	feed data as digest_ctx:update does, return false if HMAC_Update failed
+*/
+LUA_FUNCTION(openssl_hmac_ctx_update)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac_ctx");
+	int ret;
+
+	luaL_checkany(L,2);
+	ret = openssl_feed_args(L,2,openssl_hmac_feed,ctx);
+
+	lua_pushboolean(L,ret);
+	return 1;
+}
+/* }}} */
+
+/*  hmac_ctx:final([string format='raw'])->string{{{1
+
+	return mac of all data updated, ctx restart with the same key and can be used again.
+	return nil if failed
+*/
+LUA_FUNCTION(openssl_hmac_ctx_final)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac_ctx");
+	int format = openssl_get_format(L,2);
+	unsigned char buf[EVP_MAX_MD_SIZE];
+	unsigned int blen = EVP_MAX_MD_SIZE;
+
+	int ret = HMAC_OK(HMAC_Final(ctx, buf, &blen));
+
+	ret = HMAC_RESTART(ctx) && ret;
+	if (!ret)
+		return 0;
+	openssl_push_format(L,buf,blen,format);
+	return 1;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_hmac_ctx_tostring)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac_ctx");
+	lua_pushfstring(L,"openssl.hmac_ctx:%p",ctx);
+	return 1;
+}
+
+LUA_FUNCTION(openssl_hmac_ctx_gc)
+{
+	HMAC_CTX* ctx = CHECK_OBJECT(1,HMAC_CTX,"openssl.hmac_ctx");
+	openssl_hmac_ctx_free(ctx);
+	return 0;
+}
+
+static luaL_Reg hmac_funs[] = {
+	{"mac",				openssl_hmac_mac},
+	{"mac_many",		openssl_hmac_mac_many},
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	{"init",			openssl_hmac_init},
+#endif
+	{"info",			openssl_hmac_info},
+
+	{"__tostring",		openssl_hmac_tostring},
+	{"__gc",			openssl_hmac_free},
+	{NULL, NULL}
+};
+
+static luaL_Reg hmac_ctx_funs[] = {
+	{"update",			openssl_hmac_ctx_update},
+	{"final",			openssl_hmac_ctx_final},
+
+	{"__tostring",		openssl_hmac_ctx_tostring},
+	{"__gc",			openssl_hmac_ctx_gc},
+	{NULL, NULL}
+};
+
+int openssl_register_hmac(lua_State* L)
+{
+	auxiliar_newclass(L,"openssl.hmac",		hmac_funs);
+	auxiliar_newclass(L,"openssl.hmac_ctx",	hmac_ctx_funs);
+	return 0;
+}
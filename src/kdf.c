@@ -0,0 +1,304 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* kdf module for the Lua/OpenSSL binding.
+ *
+ * Password and key derivation functions, exported as the openssl.kdf table. A digest is
+ * given by name, nid or openssl.evp_digest object.
+ * kdf.pbkdf2()
+ * kdf.pbkdf2_many()
+ * kdf.scrypt()
+ * kdf.hkdf()
+ */
+
+static const EVP_MD* openssl_kdf_md(lua_State* L, int idx, const EVP_MD* def)
+{
+	const EVP_MD* md;
+	if (lua_isnoneornil(L, idx))
+		return def;
+	md = GET_DIGEST(idx);
+	if (md==NULL)
+		luaL_argerror(L, idx, "unknown digest method");
+	return md;
+}
+
+static int openssl_pbkdf2(const char* pass, size_t passlen, const unsigned char* salt, size_t saltlen,
+	int iter, const EVP_MD* md, int keylen, unsigned char* out)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	return PKCS5_PBKDF2_HMAC(pass, (int)passlen, salt, (int)saltlen, iter, md, keylen, out);
+#else
+	if (EVP_MD_type(md)!=NID_sha1)
+		return 0;
+	return PKCS5_PBKDF2_HMAC_SHA1(pass, (int)passlen, (unsigned char*)salt, (int)saltlen, iter, keylen, out);
+#endif
+}
+
+/*  openssl.kdf.pbkdf2(string password, string salt, number iter [,number keylen [,evp_digest|string md='sha1']])->string{{{1
+
+	PBKDF2 of RFC 2898 with HMAC of md as PRF, keylen default to size of md.
+	before openssl 1.0.0 only sha1 is supported
+*/
+static LUA_FUNCTION(openssl_kdf_pbkdf2)
+{
+	size_t passlen, saltlen;
+	const char* pass = luaL_checklstring(L, 1, &passlen);
+	const char* salt = luaL_checklstring(L, 2, &saltlen);
+	int iter = luaL_checkint(L, 3);
+	const EVP_MD* md = openssl_kdf_md(L, 5, EVP_sha1());
+	int keylen = luaL_optint(L, 4, EVP_MD_size(md));
+	unsigned char* out;
+	int ret;
+
+	luaL_argcheck(L, iter>0, 3, "iter must be positive");
+	luaL_argcheck(L, keylen>0, 4, "keylen must be positive");
+	out = malloc(keylen);
+	if (out==NULL)
+		luaL_error(L, "out of memory");
+	ret = openssl_pbkdf2(pass, passlen, (const unsigned char*)salt, saltlen, iter, md, keylen, out);
+	if (ret)
+		lua_pushlstring(L, (const char*)out, keylen);
+	OPENSSL_cleanse(out, keylen);
+	free(out);
+	return ret ? 1 : 0;
+}
+/* }}} */
+
+/* {{{ pbkdf2_many */
+typedef struct {
+	const char* pass;
+	size_t passlen;
+	const unsigned char* salt;
+	size_t saltlen;
+	int iter;
+	int ok;
+} kdf_job_t;
+
+typedef struct {
+	const EVP_MD* md;
+	int keylen;
+	kdf_job_t* jobs;
+	unsigned char* out;
+} kdf_many_t;
+
+static void kdf_pbkdf2_job(void* arg, int i)
+{
+	kdf_many_t* m = (kdf_many_t*)arg;
+	kdf_job_t* j = m->jobs+i;
+	j->ok = openssl_pbkdf2(j->pass, j->passlen, j->salt, j->saltlen, j->iter, m->md, m->keylen,
+		m->out+(size_t)i*m->keylen);
+}
+
+/* string item i of table at idx, or the string at idx itself, kept alive by the argument */
+static const char* kdf_item(lua_State* L, int idx, int i, size_t* len)
+{
+	const char* s;
+	if (lua_type(L, idx)==LUA_TSTRING)
+		return lua_tolstring(L, idx, len);
+	lua_rawgeti(L, idx, i);
+	if (lua_type(L, -1)!=LUA_TSTRING)
+		luaL_error(L, "#%d item %d must be string", idx, i);
+	s = lua_tolstring(L, -1, len);
+	lua_pop(L, 1);
+	return s;
+}
+
+/*  openssl.kdf.pbkdf2_many(table passwords, table|string salts, table|number iters [,table opts])->table{{{1
+
+	derive a key for every password, salts and iters are arrays matching passwords or one
+	value for all. opts.keylen and opts.md as pbkdf2, opts.threads is number of threads
+	that derive keys at the same time, default 1. return array of keys, or nil and index
+	of the first password failed
+*/
+static LUA_FUNCTION(openssl_kdf_pbkdf2_many)
+{
+	kdf_many_t m;
+	int n, i, threads;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_type(L, 2)!=LUA_TSTRING)
+		luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_isnumber(L, 3))
+		luaL_checktype(L, 3, LUA_TTABLE);
+	n = lua_objlen(L, 1);
+	m.md = EVP_sha1();
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "md");
+		m.md = openssl_kdf_md(L, lua_gettop(L), m.md);
+		lua_pop(L, 1);
+	}
+	m.keylen = (int)openssl_opt_number(L, 4, "keylen", EVP_MD_size(m.md));
+	threads = openssl_opt_threads(L, 4);
+	if (m.keylen<=0)
+		luaL_error(L, "option keylen must be positive");
+
+	m.jobs = lua_newuserdata(L, (n>0?n:1)*sizeof(kdf_job_t));
+	for (i=0; i<n; i++) {
+		kdf_job_t* j = m.jobs+i;
+		j->pass = kdf_item(L, 1, i+1, &j->passlen);
+		j->salt = (const unsigned char*)kdf_item(L, 2, i+1, &j->saltlen);
+		if (lua_isnumber(L, 3))
+			j->iter = lua_tointeger(L, 3);
+		else {
+			lua_rawgeti(L, 3, i+1);
+			j->iter = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		if (j->iter<=0)
+			luaL_error(L, "#3 iter of item %d must be positive", i+1);
+	}
+	m.out = malloc((n>0?n:1)*(size_t)m.keylen);
+	if (m.out==NULL)
+		luaL_error(L, "out of memory");
+
+	openssl_thread_run(threads, n, kdf_pbkdf2_job, &m);
+
+	lua_createtable(L, n, 0);
+	for (i=0; i<n; i++) {
+		if (!m.jobs[i].ok) {
+			lua_pushnil(L);
+			lua_pushinteger(L, i+1);
+			break;
+		}
+		lua_pushlstring(L, (const char*)m.out+(size_t)i*m.keylen, m.keylen);
+		lua_rawseti(L, -2, i+1);
+	}
+	OPENSSL_cleanse(m.out, (n>0?n:1)*(size_t)m.keylen);
+	free(m.out);
+	return i<n ? 2 : 1;
+}
+/* }}} */
+/* }}} */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_SCRYPT)
+/*  openssl.kdf.scrypt(string password, string salt, number N, number r, number p, number keylen [,number maxmem])->string{{{1
+
+	scrypt of RFC 7914, need openssl 1.1.0. maxmem is limit of memory used in bytes,
+	default 32MB. return nil if parameters are invalid or need more memory than maxmem
+*/
+static LUA_FUNCTION(openssl_kdf_scrypt)
+{
+	size_t passlen, saltlen;
+	const char* pass = luaL_checklstring(L, 1, &passlen);
+	const char* salt = luaL_checklstring(L, 2, &saltlen);
+	lua_Number N = luaL_checknumber(L, 3);
+	lua_Number r = luaL_checknumber(L, 4);
+	lua_Number p = luaL_checknumber(L, 5);
+	int keylen = luaL_checkint(L, 6);
+	lua_Number maxmem = luaL_optnumber(L, 7, 0);
+	unsigned char* out;
+	int ret;
+
+	luaL_argcheck(L, N>1, 3, "N must be greater than 1");
+	luaL_argcheck(L, r>0, 4, "r must be positive");
+	luaL_argcheck(L, p>0, 5, "p must be positive");
+	luaL_argcheck(L, keylen>0, 6, "keylen must be positive");
+	luaL_argcheck(L, maxmem>=0, 7, "maxmem must not be negative");
+	out = malloc(keylen);
+	if (out==NULL)
+		luaL_error(L, "out of memory");
+	ret = EVP_PBE_scrypt(pass, passlen, (const unsigned char*)salt, saltlen,
+		(uint64_t)N, (uint64_t)r, (uint64_t)p, (uint64_t)maxmem, out, keylen);
+	if (ret)
+		lua_pushlstring(L, (const char*)out, keylen);
+	OPENSSL_cleanse(out, keylen);
+	free(out);
+	return ret ? 1 : 0;
+}
+/* }}} */
+#endif
+
+/* extract and expand of RFC 5869, empty salt means hash length of zeros */
+static int openssl_hkdf(const EVP_MD* md, const unsigned char* key, size_t keylen,
+	const unsigned char* salt, size_t saltlen, const unsigned char* info, size_t infolen,
+	unsigned char* out, size_t outlen)
+{
+	unsigned char zero[EVP_MAX_MD_SIZE] = {0};
+	unsigned char prk[EVP_MAX_MD_SIZE];
+	unsigned char blk[EVP_MAX_MD_SIZE];
+	unsigned int prklen, n;
+	size_t mdlen = EVP_MD_size(md), tlen = 0, done = 0;
+	unsigned char* t = malloc(mdlen+infolen+1);
+	int i, ok = t!=NULL;
+
+	if (saltlen==0) {
+		salt = zero;
+		saltlen = mdlen;
+	}
+	ok = ok && HMAC(md, salt, (int)saltlen, key, keylen, prk, &prklen)!=NULL;
+	for (i=1; ok && done<outlen; i++) {
+		/* T(i) = HMAC(PRK, T(i-1) | info | i) */
+		memcpy(t+tlen, info, infolen);
+		t[tlen+infolen] = (unsigned char)i;
+		ok = HMAC(md, prk, prklen, t, tlen+infolen+1, blk, &n)!=NULL;
+		if (ok) {
+			size_t c = outlen-done<n ? outlen-done : n;
+			memcpy(out+done, blk, c);
+			memcpy(t, blk, n);
+			tlen = n;
+			done += c;
+		}
+	}
+	OPENSSL_cleanse(prk, sizeof(prk));
+	OPENSSL_cleanse(blk, sizeof(blk));
+	if (t) {
+		OPENSSL_cleanse(t, mdlen+infolen+1);
+		free(t);
+	}
+	return ok;
+}
+
+/*  openssl.kdf.hkdf(string key, string salt, string info, number keylen [,evp_digest|string md='sha256'])->string{{{1
+
+	HKDF of RFC 5869, salt and info may be nil or empty, keylen at most 255 times
+	size of md
+*/
+static LUA_FUNCTION(openssl_kdf_hkdf)
+{
+	size_t keylen, saltlen = 0, infolen = 0;
+	const char* key = luaL_checklstring(L, 1, &keylen);
+	const char* salt = luaL_optlstring(L, 2, "", &saltlen);
+	const char* info = luaL_optlstring(L, 3, "", &infolen);
+	int outlen = luaL_checkint(L, 4);
+	const EVP_MD* md = openssl_kdf_md(L, 5, EVP_sha256());
+	unsigned char* out;
+	int ret;
+
+	luaL_argcheck(L, outlen>0 && outlen<=255*EVP_MD_size(md), 4, "keylen must be in 1 to 255 times size of md");
+	out = malloc(outlen);
+	if (out==NULL)
+		luaL_error(L, "out of memory");
+	ret = openssl_hkdf(md, (const unsigned char*)key, keylen, (const unsigned char*)salt, saltlen,
+		(const unsigned char*)info, infolen, out, outlen);
+	if (ret)
+		lua_pushlstring(L, (const char*)out, outlen);
+	OPENSSL_cleanse(out, outlen);
+	free(out);
+	return ret ? 1 : 0;
+}
+/* }}} */
+
+static luaL_Reg kdf_funs[] = {
+	{"pbkdf2",		openssl_kdf_pbkdf2},
+	{"pbkdf2_many",	openssl_kdf_pbkdf2_many},
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_SCRYPT)
+	{"scrypt",		openssl_kdf_scrypt},
+#endif
+	{"hkdf",		openssl_kdf_hkdf},
+
+	{NULL,			NULL}
+};
+
+/* set field kdf of the openssl table on top of stack */
+int openssl_register_kdf(lua_State* L)
+{
+	lua_newtable(L);
+	luaL_register(L, NULL, kdf_funs);
+	lua_setfield(L, -2, "kdf");
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* keypool module for the Lua/OpenSSL binding.
+ *
+ * An openssl.keypool keeps up to target keys generated ahead by its own threads, take
+ * returns one of them at once and the threads make a new one in background. Workers
+ * only run C code and never touch the lua_State.
+ * keypool_new()
+ * keypool:take()
+ * keypool:stats()
+ * keypool:close()
+ */
+
+#define KEYPOOL_MAX_TARGET	65536
+#define KEYPOOL_MAX_THREADS	OPENSSL_MAX_THREADS
+
+typedef struct {
+	openssl_lock* lock;
+	int kind;
+	int bits;
+	unsigned long e;
+	int generator;
+#ifdef EVP_PKEY_EC
+	EC_GROUP* group;
+#endif
+
+	EVP_PKEY** keys;
+	int count;
+	int pending;
+	int target;
+
+	void** threads;
+	int nthreads;
+	int alive;				/* workers not exited yet */
+	int stop;
+
+	double generated;
+	double taken;
+	double misses;
+	double failed;
+} keypool_t;
+
+/* make one key, called by workers without lock and by take when pool is empty */
+static EVP_PKEY* keypool_generate(keypool_t* p)
+{
+	EVP_PKEY* pkey = EVP_PKEY_new();
+	int ok = 0;
+
+	if (pkey==NULL)
+		return NULL;
+	switch (p->kind) {
+		case OPENSSL_KEYTYPE_RSA:
+			{
+				RSA* rsa = RSA_new();
+				BIGNUM* e = BN_new();
+				ok = rsa && e && BN_set_word(e, p->e) && RSA_generate_key_ex(rsa, p->bits, e, NULL)
+					&& EVP_PKEY_assign_RSA(pkey, rsa);
+				if (!ok && rsa)
+					RSA_free(rsa);
+				BN_free(e);
+			}
+			break;
+		case OPENSSL_KEYTYPE_DSA:
+			{
+				DSA* dsa = DSA_new();
+				ok = dsa && DSA_generate_parameters_ex(dsa, p->bits, NULL, 0, NULL, NULL, NULL)
+					&& DSA_generate_key(dsa) && EVP_PKEY_assign_DSA(pkey, dsa);
+				if (!ok && dsa)
+					DSA_free(dsa);
+			}
+			break;
+		case OPENSSL_KEYTYPE_DH:
+			{
+				DH* dh = DH_new();
+				ok = dh && DH_generate_parameters_ex(dh, p->bits, p->generator, NULL)
+					&& DH_generate_key(dh) && EVP_PKEY_assign_DH(pkey, dh);
+				if (!ok && dh)
+					DH_free(dh);
+			}
+			break;
+#ifdef EVP_PKEY_EC
+		case OPENSSL_KEYTYPE_EC:
+			{
+				EC_KEY* ec = EC_KEY_new();
+				ok = ec && EC_KEY_set_group(ec, p->group) && EC_KEY_generate_key(ec)
+					&& EVP_PKEY_assign_EC_KEY(pkey, ec);
+				if (!ok && ec)
+					EC_KEY_free(ec);
+			}
+			break;
+#endif
+	}
+	if (!ok && pkey) {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+	}
+	return pkey;
+}
+
+static void keypool_work(void* arg)
+{
+	keypool_t* p = (keypool_t*)arg;
+
+	openssl_lock_acquire(p->lock);
+	while (!p->stop) {
+		EVP_PKEY* pkey;
+		if (p->count + p->pending >= p->target) {
+			openssl_lock_wait(p->lock);
+			continue;
+		}
+		p->pending++;
+		openssl_lock_release(p->lock);
+
+		pkey = keypool_generate(p);
+
+		openssl_lock_acquire(p->lock);
+		p->pending--;
+		if (pkey==NULL) {
+			/* the same parameters will fail again, leave it to take */
+			p->failed++;
+			break;
+		}
+		p->keys[p->count++] = pkey;
+		p->generated++;
+	}
+	p->alive--;
+	openssl_lock_release(p->lock);
+}
+
+/* stop and join workers, free keys left */
+static void keypool_close(keypool_t* p)
+{
+	int i;
+	if (p->threads==NULL)
+		return;
+
+	openssl_lock_acquire(p->lock);
+	p->stop = 1;
+	openssl_lock_wake(p->lock);
+	openssl_lock_release(p->lock);
+	for (i=0; i<p->nthreads; i++)
+		openssl_thread_join(p->threads[i]);
+	free(p->threads);
+	p->threads = NULL;
+
+	for (i=0; i<p->count; i++)
+		EVP_PKEY_free(p->keys[i]);
+	p->count = 0;
+}
+
+/*  openssl.keypool_new(table opts) => keypool{{{1
+
+	opts.type is rsa, dsa, dh or ec, default rsa. opts.bits as openssl.pkey_new, opts.e is
+	rsa exponent, default 65537, opts.generator of dh default 2, opts.curve of ec default
+	prime256v1. opts.target is number of keys kept ready, default 16, opts.threads is
+	number of threads filling the pool, default 1
+*/
+LUA_FUNCTION(openssl_keypool_new)
+{
+	keypool_t* p;
+	const char* type = "rsa";
+	int kind, i;
+	int bits, target, threads;
+	lua_Number n;
+#ifdef EVP_PKEY_EC
+	int nid = NID_X9_62_prime256v1;
+#endif
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "type");
+	if (!lua_isnil(L, -1))
+		type = luaL_checkstring(L, -1);
+	if (strcasecmp(type, "rsa")==0)
+		kind = OPENSSL_KEYTYPE_RSA;
+	else if (strcasecmp(type, "dsa")==0)
+		kind = OPENSSL_KEYTYPE_DSA;
+	else if (strcasecmp(type, "dh")==0)
+		kind = OPENSSL_KEYTYPE_DH;
+#ifdef EVP_PKEY_EC
+	else if (strcasecmp(type, "ec")==0) {
+		kind = OPENSSL_KEYTYPE_EC;
+		lua_getfield(L, 1, "curve");
+		if (!lua_isnil(L, -1))
+			nid = openssl_ec_curve_nid(L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+#endif
+	else
+		return luaL_error(L, "not support %s!!!!", type);
+	lua_pop(L, 1);
+
+	bits = (int)openssl_opt_number(L, 1, "bits", kind==OPENSSL_KEYTYPE_DH ? 512 : 1024);
+	n = openssl_opt_number(L, 1, "target", 16);
+	luaL_argcheck(L, n>0 && n<=KEYPOOL_MAX_TARGET, 1, "target out of range");
+	target = (int)n;
+	n = openssl_opt_number(L, 1, "threads", 1);
+	luaL_argcheck(L, n>=0 && n<=KEYPOOL_MAX_THREADS, 1, "threads out of range");
+	threads = (int)n;
+
+	p = malloc(sizeof(keypool_t));
+	memset(p, 0, sizeof(keypool_t));
+	p->kind = kind;
+	p->bits = bits;
+	p->e = (unsigned long)openssl_opt_number(L, 1, "e", 65537);
+	p->generator = (int)openssl_opt_number(L, 1, "generator", 2);
+	p->target = target;
+	p->keys = malloc(target*sizeof(EVP_PKEY*));
+	p->lock = openssl_lock_new();
+	p->threads = malloc((threads>0 ? threads : 1)*sizeof(void*));
+	PUSH_OBJECT(p, "openssl.keypool");
+#ifdef EVP_PKEY_EC
+	if (kind==OPENSSL_KEYTYPE_EC) {
+		p->group = openssl_ec_group_new(nid);
+		if (p->group==NULL)
+			luaL_error(L, "curve %s not supported", OBJ_nid2sn(nid));
+	}
+#endif
+
+	for (i=0; i<threads; i++) {
+		/* count worker before it runs, it may exit at once */
+		openssl_lock_acquire(p->lock);
+		p->alive++;
+		openssl_lock_release(p->lock);
+		p->threads[p->nthreads] = openssl_thread_start(keypool_work, p);
+		if (p->threads[p->nthreads]==NULL) {
+			openssl_lock_acquire(p->lock);
+			p->alive--;
+			openssl_lock_release(p->lock);
+			break;
+		}
+		p->nthreads++;
+	}
+	return 1;
+}
+/* }}} */
+
+/*  keypool:take() => evp_pkey{{{1
+
+	return a key made ahead, or make one now if the pool is empty
+*/
+LUA_FUNCTION(openssl_keypool_take)
+{
+	keypool_t* p = CHECK_OBJECT(1, keypool_t, "openssl.keypool");
+	EVP_PKEY* pkey = NULL;
+
+	openssl_lock_acquire(p->lock);
+	if (p->count>0) {
+		pkey = p->keys[--p->count];
+		p->taken++;
+		openssl_lock_wake(p->lock);
+	} else
+		p->misses++;
+	openssl_lock_release(p->lock);
+
+	if (pkey==NULL)
+		pkey = keypool_generate(p);
+	if (pkey==NULL)
+		return 0;
+	PUSH_OBJECT(pkey, "openssl.evp_pkey");
+	return 1;
+}
+/* }}} */
+
+/*  keypool:stats() -> table{{{1
+
+	return table with size of keys ready, target, threads still running, a worker exits
+	after its key generation failed, generated by threads, taken from pool, misses made
+	by take, failed
+*/
+LUA_FUNCTION(openssl_keypool_stats)
+{
+	keypool_t* p = CHECK_OBJECT(1, keypool_t, "openssl.keypool");
+
+	lua_newtable(L);
+	openssl_lock_acquire(p->lock);
+	add_assoc_int(L, "size", p->count);
+	add_assoc_int(L, "target", p->target);
+	add_assoc_int(L, "threads", p->alive);
+	lua_pushnumber(L, p->generated);
+	lua_setfield(L, -2, "generated");
+	lua_pushnumber(L, p->taken);
+	lua_setfield(L, -2, "taken");
+	lua_pushnumber(L, p->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, p->failed);
+	lua_setfield(L, -2, "failed");
+	openssl_lock_release(p->lock);
+	return 1;
+}
+/* }}} */
+
+/*  keypool:close(){{{1
+
+	stop threads and free keys not taken, take still works but makes every key now
+*/
+LUA_FUNCTION(openssl_keypool_close)
+{
+	keypool_t* p = CHECK_OBJECT(1, keypool_t, "openssl.keypool");
+	keypool_close(p);
+	return 0;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_keypool_free)
+{
+	keypool_t* p = CHECK_OBJECT(1, keypool_t, "openssl.keypool");
+	keypool_close(p);
+#ifdef EVP_PKEY_EC
+	if (p->group)
+		EC_GROUP_free(p->group);
+#endif
+	openssl_lock_free(p->lock);
+	free(p->keys);
+	free(p);
+	return 0;
+}
+
+LUA_FUNCTION(openssl_keypool_tostring)
+{
+	keypool_t* p = CHECK_OBJECT(1, keypool_t, "openssl.keypool");
+	lua_pushfstring(L, "openssl.keypool:%p", p);
+	return 1;
+}
+
+static luaL_Reg keypool_funs[] = {
+	{"take",		openssl_keypool_take},
+	{"stats",		openssl_keypool_stats},
+	{"close",		openssl_keypool_close},
+
+	{"__gc",		openssl_keypool_free},
+	{"__tostring",	openssl_keypool_tostring},
+	{NULL, NULL}
+};
+
+int openssl_register_keypool(lua_State* L)
+{
+	auxiliar_newclass(L,"openssl.keypool",	keypool_funs);
+	return 0;
+}
@@ -4,6 +4,13 @@ $Revision:$
 */
 
 #include "openssl.h"
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 void add_index_bool(lua_State* L, int i, int b){
@@ -249,6 +256,113 @@ void openssl_add_method(const OBJ_NAME *name, void *arg)
 	}
 }
 
+/* {{{ method cache, one table in registry for digests and one for ciphers, mapping
+   name, nid and method pointer to a shared userdata, and true/false to sorted listings */
+static const char* openssl_method_class(int type)
+{
+	return type==OBJ_NAME_TYPE_MD_METH ? "openssl.evp_digest" : "openssl.evp_cipher";
+}
+
+static void openssl_method_cache(lua_State* L, int type)
+{
+	const char* key = type==OBJ_NAME_TYPE_MD_METH ? "openssl.evp_digest.cache" : "openssl.evp_cipher.cache";
+	lua_getfield(L, LUA_REGISTRYINDEX, key);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, key);
+	}
+}
+
+/* push the only userdata of method */
+void openssl_method_push(lua_State* L, const void* method, int type)
+{
+	openssl_method_cache(L, type);
+	lua_pushlightuserdata(L, (void*)method);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		PUSH_OBJECT((void*)method, openssl_method_class(type));
+		lua_pushlightuserdata(L, (void*)method);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+/* method of name, nid, asn1_object or method userdata at idx, NULL if unknown */
+const void* openssl_method_get(lua_State* L, int idx, int type)
+{
+	const char* tname = openssl_method_class(type);
+	const void* method = NULL;
+	int t = lua_type(L, idx);
+
+	if (t==LUA_TUSERDATA && auxiliar_isclass(L, tname, idx))
+		return *(void**)lua_touserdata(L, idx);
+
+	if (idx<0 && idx>LUA_REGISTRYINDEX)
+		idx = lua_gettop(L) + idx + 1;
+	openssl_method_cache(L, type);
+	if (t==LUA_TSTRING || t==LUA_TNUMBER)
+		lua_pushvalue(L, idx);
+	else if (t==LUA_TUSERDATA && auxiliar_isclass(L, "openssl.asn1_object", idx))
+		lua_pushinteger(L, OBJ_obj2nid(CHECK_OBJECT(idx, ASN1_OBJECT, "openssl.asn1_object")));
+	else
+		luaL_typerror(L, idx, tname);
+
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	if (lua_isuserdata(L, -1))
+		method = *(void**)lua_touserdata(L, -1);
+	else {
+		if (lua_type(L, -2)==LUA_TSTRING)
+			method = type==OBJ_NAME_TYPE_MD_METH ? (const void*)EVP_get_digestbyname(lua_tostring(L, -2))
+				: (const void*)EVP_get_cipherbyname(lua_tostring(L, -2));
+		else {
+			int nid = lua_tointeger(L, -2);
+			method = type==OBJ_NAME_TYPE_MD_METH ? (const void*)EVP_get_digestbynid(nid)
+				: (const void*)EVP_get_cipherbynid(nid);
+		}
+		if (method) {
+			lua_pop(L, 1);
+			openssl_method_push(L, method, type);
+			lua_rawset(L, -3);
+			lua_pop(L, 1);
+			return method;
+		}
+	}
+	lua_pop(L, 3);
+	return method;
+}
+
+/* push a new array of sorted names of all methods, copied from a listing built once */
+void openssl_method_list(lua_State* L, int type, int aliases)
+{
+	int i, n;
+	openssl_method_cache(L, type);
+	lua_pushboolean(L, aliases);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		OBJ_NAME_do_all_sorted(type, aliases ? openssl_add_method_or_alias: openssl_add_method, L);
+		lua_pushboolean(L, aliases);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+
+	n = lua_objlen(L, -1);
+	lua_createtable(L, n, 0);
+	for (i=1; i<=n; i++) {
+		lua_rawgeti(L, -2, i);
+		lua_rawseti(L, -2, i);
+	}
+	lua_remove(L, -2);
+}
+/* }}} */
+
 /* {{{ proto string openssl_random_bytes(integer length [, &bool returned_strong_result])
    Returns a string of the length specified filled with random pseudo bytes */
 LUA_FUNCTION(openssl_random_bytes)
@@ -297,6 +411,488 @@ LUA_FUNCTION(openssl_random_bytes)
 
 /* }}} */
 
+/* {{{ openssl_file_feed
+   Pass length bytes of file path starting at offset (all to end of file when length<0)
+   to cb without copying them through Lua strings. Regular files are mapped in windows of
+   OPENSSL_FILE_MAP_SIZE bytes, anything that can not be mapped is read in chunks of
+   OPENSSL_FILE_READ_SIZE bytes. Return 1 on success, 0 if the file can not be read or
+   cb returns 0 */
+int openssl_file_feed(const char* path, lua_Number offset, lua_Number length, openssl_feed_cb cb, void* arg)
+{
+	unsigned char* buf;
+	int ret = 1;
+#ifndef WIN32
+	struct stat st;
+	off_t pos = (off_t)offset;
+	off_t end = -1;
+	int fd = open(path, O_RDONLY);
+
+	if (fd<0 || offset<0)
+	{
+		if (fd>=0) close(fd);
+		return 0;
+	}
+	if (fstat(fd, &st)==0 && S_ISREG(st.st_mode))
+	{
+		long pg = sysconf(_SC_PAGESIZE);
+		end = st.st_size;
+		if (length>=0 && pos + (off_t)length < end)
+			end = pos + (off_t)length;
+
+		while (ret && pos<end)
+		{
+			off_t base = pos - pos % pg;
+			size_t maplen = (size_t)(end-base > OPENSSL_FILE_MAP_SIZE ? OPENSSL_FILE_MAP_SIZE : end-base);
+			unsigned char* p = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, base);
+			if (p==MAP_FAILED)
+				break;
+#ifdef MADV_SEQUENTIAL
+			madvise(p, maplen, MADV_SEQUENTIAL);
+#endif
+			ret = cb(arg, p + (pos-base), maplen - (size_t)(pos-base));
+			munmap(p, maplen);
+			pos = base + maplen;
+		}
+		if (!ret || pos>=end)
+		{
+			close(fd);
+			return ret;
+		}
+	}
+	else if (length>=0)
+		end = pos + (off_t)length;
+
+	/* mmap not possible, fall back to large reads */
+	if (lseek(fd, pos, SEEK_SET)<0 && pos>0)
+	{
+		close(fd);
+		return 0;
+	}
+	buf = malloc(OPENSSL_FILE_READ_SIZE);
+	while (ret && (end<0 || pos<end))
+	{
+		size_t want = OPENSSL_FILE_READ_SIZE;
+		ssize_t n;
+		if (end>=0 && end-pos < (off_t)want)
+			want = (size_t)(end-pos);
+		n = read(fd, buf, want);
+		if (n<0)
+			ret = 0;
+		else if (n==0)
+			break;
+		else {
+			ret = cb(arg, buf, (size_t)n);
+			pos += n;
+		}
+	}
+	free(buf);
+	close(fd);
+#else
+	__int64 remain = length<0 ? -1 : (__int64)length;
+	FILE* fp = fopen(path, "rb");
+
+	if (fp==NULL || offset<0 || _fseeki64(fp, (__int64)offset, SEEK_SET)!=0)
+	{
+		if (fp) fclose(fp);
+		return 0;
+	}
+	buf = malloc(OPENSSL_FILE_READ_SIZE);
+	while (ret && remain!=0)
+	{
+		size_t want = OPENSSL_FILE_READ_SIZE;
+		size_t n;
+		if (remain>0 && remain < (__int64)want)
+			want = (size_t)remain;
+		n = fread(buf, 1, want, fp);
+		if (n==0) {
+			ret = !ferror(fp);
+			break;
+		}
+		ret = cb(arg, buf, n);
+		if (remain>0)
+			remain -= n;
+	}
+	free(buf);
+	fclose(fp);
+#endif
+	return ret;
+}
+/* }}} */
+
+/* size of file path in bytes, -1 if it can not be stat */
+lua_Number openssl_file_size(const char* path)
+{
+#ifndef WIN32
+	struct stat st;
+	if (stat(path, &st)!=0)
+		return -1;
+#else
+	struct _stati64 st;
+	if (_stati64(path, &st)!=0)
+		return -1;
+#endif
+	return (lua_Number)st.st_size;
+}
+
+/* read len bytes at offset of fp into buf, return 1 only if all of them are read */
+int openssl_file_read_at(FILE* fp, lua_Number offset, unsigned char* buf, size_t len)
+{
+#ifndef WIN32
+	if (fseeko(fp, (off_t)offset, SEEK_SET)!=0)
+		return 0;
+#else
+	if (_fseeki64(fp, (__int64)offset, SEEK_SET)!=0)
+		return 0;
+#endif
+	return fread(buf, 1, len, fp)==len;
+}
+
+/* number field key of option table at idx, def when idx is none or nil or key is not set */
+lua_Number openssl_opt_number(lua_State* L, int idx, const char* key, lua_Number def)
+{
+	lua_Number n = def;
+	if (lua_isnoneornil(L,idx))
+		return def;
+	luaL_checktype(L,idx,LUA_TTABLE);
+	lua_getfield(L,idx,key);
+	if (!lua_isnil(L,-1)) {
+		if (!lua_isnumber(L,-1))
+			luaL_error(L,"option %s must be number", key);
+		n = lua_tonumber(L,-1);
+	}
+	lua_pop(L,1);
+	return n;
+}
+
+/* threads field of option table at idx, clamped to [1, OPENSSL_MAX_THREADS] before any cast */
+int openssl_opt_threads(lua_State* L, int idx)
+{
+	lua_Number n = openssl_opt_number(L,idx,"threads",1);
+	if (!(n>=1))
+		return 1;
+	if (n>OPENSSL_MAX_THREADS)
+		return OPENSSL_MAX_THREADS;
+	return (int)n;
+}
+
+/* string field key of options table at idx, NULL if not given, the string is kept by the table */
+const char* openssl_opt_lstring(lua_State* L, int idx, const char* key, size_t* len)
+{
+	const char* s = NULL;
+	if (lua_isnoneornil(L,idx))
+		return NULL;
+	luaL_checktype(L,idx,LUA_TTABLE);
+	lua_getfield(L,idx,key);
+	if (!lua_isnil(L,-1)) {
+		if (lua_type(L,-1)!=LUA_TSTRING)
+			luaL_error(L,"option %s must be string", key);
+		s = lua_tolstring(L,-1,len);
+	}
+	lua_pop(L,1);
+	return s;
+}
+
+/* {{{ openssl_feed_args
+   Pass every argument from index from to top to cb. An argument may be a string, a number,
+   an openssl.buffer or an array of them, pieces are fed in order without concatenation.
+   A number is encoded as 9 bytes, a type tag then 8 bytes big endian, tag 1 for a signed
+   two's complement integer when it has no fraction part, else tag 2 for IEEE 754 double.
+   Return 1 on success, 0 if cb returns 0 */
+#define FEED_NUMBER_INTEGER	1
+#define FEED_NUMBER_DOUBLE	2
+#define FEED_NUMBER_SIZE	9
+
+static void openssl_encode_number(lua_Number n, unsigned char* p)
+{
+	int i;
+	if (n >= -9223372036854775808.0 && n < 9223372036854775808.0 && n == floor(n)) {
+		unsigned long long v = (unsigned long long)(long long)n;
+		p[0] = FEED_NUMBER_INTEGER;
+		for (i=8; i>=1; i--, v>>=8)
+			p[i] = (unsigned char)v;
+	} else {
+		double d = (double)n;
+		unsigned char* b = (unsigned char*)&d;
+		int one = 1;
+		p[0] = FEED_NUMBER_DOUBLE;
+		for (i=0; i<8; i++)
+			p[i+1] = *(char*)&one ? b[7-i] : b[i];
+	}
+}
+
+static int openssl_feed_value(lua_State* L, int idx, int arg, openssl_feed_cb cb, void* ud)
+{
+	openssl_buffer* b;
+	if (lua_type(L,idx)==LUA_TSTRING) {
+		size_t len;
+		const char* s = lua_tolstring(L,idx,&len);
+		return cb(ud,(const unsigned char*)s,len);
+	} else if (lua_type(L,idx)==LUA_TNUMBER) {
+		unsigned char num[FEED_NUMBER_SIZE];
+		openssl_encode_number(lua_tonumber(L,idx),num);
+		return cb(ud,num,FEED_NUMBER_SIZE);
+	} else if ((b=openssl_tobuffer(L,idx))!=NULL) {
+		return cb(ud,b->data,b->len);
+	}
+	luaL_argerror(L,arg,"string, number, openssl.buffer or array of them expected");
+	return 0;
+}
+
+int openssl_feed_args(lua_State* L, int from, openssl_feed_cb cb, void* ud)
+{
+	int top = lua_gettop(L);
+	int i, j, n, ret = 1;
+
+	for (i=from; ret && i<=top; i++)
+	{
+		if (lua_istable(L,i)) {
+			n = lua_objlen(L,i);
+			for (j=1; ret && j<=n; j++) {
+				lua_rawgeti(L,i,j);
+				ret = openssl_feed_value(L,-1,i,cb,ud);
+				lua_pop(L,1);
+			}
+		} else
+			ret = openssl_feed_value(L,i,i,cb,ud);
+	}
+	return ret;
+}
+
+static int openssl_count_feed(void* arg, const unsigned char* data, size_t len)
+{
+	(void)data;
+	*(size_t*)arg += len;
+	return 1;
+}
+
+/* total bytes openssl_feed_args will pass from index from */
+size_t openssl_args_length(lua_State* L, int from)
+{
+	size_t len = 0;
+	openssl_feed_args(L,from,openssl_count_feed,&len);
+	return len;
+}
+/* }}} */
+
+/* {{{ output format: raw, hex, base64 or base64url */
+static const char* const openssl_formats[] = {"raw", "hex", "base64", "base64url", NULL};
+static const char hex_digits[] = "0123456789abcdef";
+static const char b64_std[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b64_url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+int openssl_get_format(lua_State* L, int idx)
+{
+	return luaL_checkoption(L, idx, "raw", openssl_formats);
+}
+
+/* format at idx and engine after it, an engine at idx is taken as the engine of
+   calls made before format was added and format is raw */
+int openssl_get_format_engine(lua_State* L, int idx, ENGINE** e)
+{
+	*e = NULL;
+	if (lua_isuserdata(L, idx)) {
+		*e = CHECK_OBJECT(idx, ENGINE, "openssl.engine");
+		return OPENSSL_FORMAT_RAW;
+	}
+	if (!lua_isnoneornil(L, idx+1))
+		*e = CHECK_OBJECT(idx+1, ENGINE, "openssl.engine");
+	return openssl_get_format(L, idx);
+}
+
+/* size of data with len bytes after encoding */
+static size_t openssl_encoded_length(size_t len, int format)
+{
+	switch (format) {
+		case OPENSSL_FORMAT_HEX:
+			return len*2;
+		case OPENSSL_FORMAT_BASE64:
+			return (len+2)/3*4;
+		case OPENSSL_FORMAT_BASE64URL:
+			return (len*4+2)/3;
+	}
+	return len;
+}
+
+static size_t openssl_encode(const unsigned char* in, size_t len, int format, char* out)
+{
+	size_t i, o = 0;
+	unsigned long v;
+
+	if (format==OPENSSL_FORMAT_HEX) {
+		for (i=0; i<len; i++) {
+			out[o++] = hex_digits[in[i]>>4];
+			out[o++] = hex_digits[in[i]&0x0f];
+		}
+	} else if (format==OPENSSL_FORMAT_BASE64 || format==OPENSSL_FORMAT_BASE64URL) {
+		const char* t = format==OPENSSL_FORMAT_BASE64 ? b64_std : b64_url;
+		for (i=0; i+2<len; i+=3) {
+			v = ((unsigned long)in[i]<<16) | ((unsigned long)in[i+1]<<8) | in[i+2];
+			out[o++] = t[v>>18];
+			out[o++] = t[(v>>12)&0x3f];
+			out[o++] = t[(v>>6)&0x3f];
+			out[o++] = t[v&0x3f];
+		}
+		if (len-i) {
+			v = (unsigned long)in[i]<<16;
+			if (len-i==2)
+				v |= (unsigned long)in[i+1]<<8;
+			out[o++] = t[v>>18];
+			out[o++] = t[(v>>12)&0x3f];
+			if (len-i==2)
+				out[o++] = t[(v>>6)&0x3f];
+			if (format==OPENSSL_FORMAT_BASE64) {
+				if (len-i==1)
+					out[o++] = '=';
+				out[o++] = '=';
+			}
+		}
+	} else {
+		memcpy(out, in, len);
+		o = len;
+	}
+	return o;
+}
+
+static int hex_value(int c)
+{
+	if (c>='0' && c<='9') return c-'0';
+	if (c>='a' && c<='f') return c-'a'+10;
+	if (c>='A' && c<='F') return c-'A'+10;
+	return -1;
+}
+
+static int b64_value(int c)
+{
+	if (c>='A' && c<='Z') return c-'A';
+	if (c>='a' && c<='z') return c-'a'+26;
+	if (c>='0' && c<='9') return c-'0'+52;
+	if (c=='+' || c=='-') return 62;
+	if (c=='/' || c=='_') return 63;
+	return -1;
+}
+
+/* decode in to out which must have room for len bytes, base64 accept both alphabets,
+   whitespace and optional padding. return decoded length, -1 if in is not valid */
+static long openssl_decode(const char* in, size_t len, int format, unsigned char* out)
+{
+	size_t i;
+	long o = 0;
+
+	if (format==OPENSSL_FORMAT_HEX) {
+		if (len%2)
+			return -1;
+		for (i=0; i<len; i+=2) {
+			int h = hex_value((unsigned char)in[i]), l = hex_value((unsigned char)in[i+1]);
+			if (h<0 || l<0)
+				return -1;
+			out[o++] = (unsigned char)(h<<4 | l);
+		}
+	} else if (format==OPENSSL_FORMAT_BASE64 || format==OPENSSL_FORMAT_BASE64URL) {
+		unsigned long v = 0;
+		int n = 0, pad = 0;
+		for (i=0; i<len; i++) {
+			int c = (unsigned char)in[i], d;
+			if (c==' ' || c=='\t' || c=='\r' || c=='\n')
+				continue;
+			if (c=='=') {
+				pad++;
+				continue;
+			}
+			d = b64_value(c);
+			if (d<0 || pad)
+				return -1;
+			v = (v<<6) | d;
+			if (++n==4) {
+				out[o++] = (unsigned char)(v>>16);
+				out[o++] = (unsigned char)(v>>8);
+				out[o++] = (unsigned char)v;
+				v = 0;
+				n = 0;
+			}
+		}
+		if (n==1 || pad>2)
+			return -1;
+		if (n==2)
+			out[o++] = (unsigned char)(v>>4);
+		else if (n==3) {
+			out[o++] = (unsigned char)(v>>10);
+			out[o++] = (unsigned char)(v>>2);
+		}
+	} else {
+		memcpy(out, in, len);
+		o = (long)len;
+	}
+	return o;
+}
+
+/* push data encoded as format */
+void openssl_push_format(lua_State* L, const unsigned char* data, size_t len, int format)
+{
+	char buf[2*EVP_MAX_MD_SIZE];
+	size_t olen = openssl_encoded_length(len, format);
+	char* out;
+
+	if (format==OPENSSL_FORMAT_RAW) {
+		lua_pushlstring(L, (const char*)data, len);
+		return;
+	}
+	out = olen<=sizeof(buf) ? buf : malloc(olen);
+	lua_pushlstring(L, out, openssl_encode(data, len, format, out));
+	if (out!=buf)
+		free(out);
+}
+
+/* return malloced buffer of in decoded from format, NULL if in is not valid */
+unsigned char* openssl_decode_format(const char* in, size_t len, int format, size_t* outl)
+{
+	unsigned char* out = malloc(len+1);
+	long l = openssl_decode(in, len, format, out);
+	if (l<0) {
+		free(out);
+		return NULL;
+	}
+	*outl = (size_t)l;
+	return out;
+}
+
+static int openssl_codec(lua_State* L, int format)
+{
+	size_t len;
+	const char* in = luaL_checklstring(L,1,&len);
+	int encode = lua_isnoneornil(L,2) ? 1 : lua_toboolean(L,2);
+
+	if (encode)
+		openssl_push_format(L, (const unsigned char*)in, len, format);
+	else {
+		unsigned char* out = openssl_decode_format(in, len, format, &len);
+		if (out==NULL) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "invalid %s string", openssl_formats[format]);
+			return 2;
+		}
+		lua_pushlstring(L, (const char*)out, len);
+		free(out);
+	}
+	return 1;
+}
+
+/*  openssl.hex(string data [,boolean encode=true])->string{{{1
+*/
+LUA_FUNCTION(openssl_hex)
+{
+	return openssl_codec(L, OPENSSL_FORMAT_HEX);
+}
+/* }}} */
+
+/*  openssl.base64(string data [,boolean encode=true [,boolean url=false]])->string{{{1
+*/
+LUA_FUNCTION(openssl_base64)
+{
+	return openssl_codec(L, lua_toboolean(L,3) ? OPENSSL_FORMAT_BASE64URL : OPENSSL_FORMAT_BASE64);
+}
+/* }}} */
+/* }}} */
+
 LUA_FUNCTION(openssl_x509_algo_parse) {
 	X509_ALGOR *algo = CHECK_OBJECT(1,X509_ALGOR,"openssl.x509_algor");
 	BIO* bio = BIO_new(BIO_s_mem());
@@ -14,6 +14,10 @@ const static luaL_Reg eay_functions[] = {
 	/* pkey */
 	{"pkey_read",			openssl_pkey_read	},
 	{"pkey_new",			openssl_pkey_new	},
+	{"keypool_new",			openssl_keypool_new	},
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	{"pkey_ctx_new",		openssl_pkey_ctx_new	},
+#endif
 
 	/* x.509 cert funcs */
 	{"x509_read",			openssl_x509_read	},
@@ -32,16 +36,28 @@ const static luaL_Reg eay_functions[] = {
 	/* cipher/digest functions */
 	{"get_digest",			openssl_get_digest},
 	{"get_cipher",			openssl_get_cipher},
+	{"hmac_new",			openssl_hmac_new},
+#ifdef OPENSSL_HAVE_AEAD
+	{"container_open",		openssl_container_open},
+#endif
 
 	/* misc function */
 	{"random_bytes",		openssl_random_bytes	},
+	{"hex",					openssl_hex	},
+	{"base64",				openssl_base64	},
+	{"buffer_new",			openssl_buffer_new	},
 	{"error_string",		openssl_error_string	},
 	{"object_create",		openssl_object_create	},
 	{"bio_new_file",		openssl_bio_new_file	},
 	{"bio_new_mem",			openssl_bio_new_mem	},
+	{"bio_filter_md",		openssl_bio_filter_md	},
+	{"bio_filter_cipher",	openssl_bio_filter_cipher	},
+	{"bio_filter_base64",	openssl_bio_filter_base64	},
 
 	{"sign",				openssl_sign	},
 	{"verify",				openssl_verify	},
+	{"sign_many",			openssl_sign_many	},
+	{"verify_many",			openssl_verify_many	},
 	{"seal",				openssl_seal	},
 	{"open",				openssl_open	},
 
@@ -188,45 +204,83 @@ LUA_FUNCTION(openssl_error_string)
 }
 /* }}} */
 
-/* {{{ proto signature openssl_sign(string data,  evp_pkey key [, digest md|string md_alg=SHA1]) ->string
-   Signs data */
-LUA_FUNCTION(openssl_sign)
+/* digest used to sign with pkey, sha1 if md is NULL */
+static const EVP_MD* openssl_sign_md(EVP_PKEY* pkey, const EVP_MD* md)
 {
-	int data_len;
-	const char * data = luaL_checklstring(L,1,&data_len);
-	EVP_PKEY *pkey = CHECK_OBJECT(2,EVP_PKEY,"openssl.evp_pkey");
+	if(!md)
+		md = EVP_sha1();
+#if OPENSSL_VERSION_NUMBER < 0x10000000L && defined(EVP_PKEY_EC)
+	/* before 1.0.0 the digest decides the key type, ECDSA has its own sha1 */
+	if(EVP_PKEY_type(pkey->type)==EVP_PKEY_EC && EVP_MD_type(md)==NID_sha1)
+		md = EVP_ecdsa();
+#else
+	(void)pkey;
+#endif
+	return md;
+}
 
-	int siglen;
-	unsigned char *sigbuf;
+/* sign data to sig of EVP_PKEY_size bytes, return 1 and length in siglen, or 0 */
+static int openssl_sign_data(EVP_PKEY* pkey, const EVP_MD* md, const char* data, size_t data_len,
+	unsigned char* sig, unsigned int* siglen)
+{
+	EVP_MD_CTX md_ctx;
+	int ret;
 
+	EVP_SignInit(&md_ctx, openssl_sign_md(pkey, md));
+	EVP_SignUpdate(&md_ctx, data, data_len);
+	ret = EVP_SignFinal(&md_ctx, sig, siglen, pkey);
+	EVP_MD_CTX_cleanup(&md_ctx);
+	return ret;
+}
+
+/* return 1 if sig is signature of data, 0 if not, -1 on error */
+static int openssl_verify_data(EVP_PKEY* pkey, const EVP_MD* md, const char* data, size_t data_len,
+	const char* sig, size_t siglen)
+{
 	EVP_MD_CTX md_ctx;
-	
-	int ret = 0;
-	int top = lua_gettop(L);
+	int err;
 
+	EVP_VerifyInit   (&md_ctx, openssl_sign_md(pkey, md));
+	EVP_VerifyUpdate (&md_ctx, data, data_len);
+	err = EVP_VerifyFinal (&md_ctx, (unsigned char *)sig, (unsigned int)siglen, pkey);
+	EVP_MD_CTX_cleanup(&md_ctx);
+	return err;
+}
+
+/* digest at idx, NULL if none or nil */
+static const EVP_MD* openssl_sign_opt_md(lua_State* L, int idx)
+{
 	const EVP_MD *mdtype = NULL;
-	if(top>2) {
-		if(lua_isstring(L,3))
-			mdtype = EVP_get_digestbyname(lua_tostring(L,3));
-		else if(lua_isuserdata(L,3))
-			mdtype = CHECK_OBJECT(3,EVP_MD,"openssl.evp_digest");
-		else
-			luaL_error(L, "#3 must be nil, string, or openssl.evp_digest object");
+	if(!lua_isnoneornil(L,idx)) {
+		mdtype = GET_DIGEST(idx);
+		if(!mdtype)
+			luaL_error(L, "#%d unknown digest method", idx);
 	}
-	if(!mdtype)
-		mdtype = EVP_get_digestbynid(OPENSSL_ALGO_SHA1);
+	return mdtype;
+}
 
-	siglen = EVP_PKEY_size(pkey);
-	sigbuf = malloc(siglen + 1);
+/* {{{ proto signature openssl_sign(string data,  evp_pkey key [, digest md|string md_alg=SHA1 [,string format='raw']]) ->string
+   Signs data */
+LUA_FUNCTION(openssl_sign)
+{
+	size_t data_len;
+	const char * data = luaL_checklstring(L,1,&data_len);
+	EVP_PKEY *pkey = CHECK_OBJECT(2,EVP_PKEY,"openssl.evp_pkey");
+	const EVP_MD *mdtype = openssl_sign_opt_md(L,3);
+	int format = openssl_get_format(L,4);
 
-	EVP_SignInit(&md_ctx, mdtype);
-	EVP_SignUpdate(&md_ctx, data, data_len);
-	if (EVP_SignFinal (&md_ctx, sigbuf,(unsigned int *)&siglen, pkey)) {
-		lua_pushlstring(L,(char *)sigbuf, siglen);
+	unsigned int siglen = EVP_PKEY_size(pkey);
+	unsigned char *sigbuf = malloc(siglen + 1);
+	int ret = 0;
+
+	if (sigbuf==NULL)
+		luaL_error(L, "out of memory");
+
+	if (openssl_sign_data(pkey, mdtype, data, data_len, sigbuf, &siglen)) {
+		openssl_push_format(L, sigbuf, siglen, format);
 		ret = 1;
 	}
 	free(sigbuf);
-	EVP_MD_CTX_cleanup(&md_ctx);
 	return ret;
 }
 /* }}} */
@@ -235,37 +289,148 @@ LUA_FUNCTION(openssl_sign)
    Verifys data */
 LUA_FUNCTION(openssl_verify)
 {
-	int data_len, signature_len;
+	size_t data_len, signature_len;
 	const char* data = luaL_checklstring(L,1,&data_len);
 	const char* signature = luaL_checklstring(L,2,&signature_len);
-
 	EVP_PKEY *pkey = CHECK_OBJECT(3,EVP_PKEY,"openssl.evp_pkey");
-	int top = lua_gettop(L);
-	int err;
-	EVP_MD_CTX     md_ctx;
+	const EVP_MD *mdtype = openssl_sign_opt_md(L,4);
 
-	const EVP_MD *mdtype = NULL;
-	if(top>3) {
-		if(lua_isstring(L,4))
-			mdtype = EVP_get_digestbyname(lua_tostring(L,4));
-		else if(lua_isuserdata(L,4))
-			mdtype = CHECK_OBJECT(4,EVP_MD,"openssl.evp_digest");
-		else
-			luaL_error(L, "#4 must be nil, string, or openssl.evp_digest object");
+	lua_pushinteger(L, openssl_verify_data(pkey, mdtype, data, data_len, signature, signature_len));
+	return 1;
+}
+/* }}} */
+
+/* {{{ sign_many and verify_many */
+typedef struct {
+	const char* data;
+	size_t data_len;
+	const char* sig;
+	size_t siglen;
+	EVP_PKEY* pkey;
+	int ret;
+} sign_job_t;
+
+typedef struct {
+	const EVP_MD* md;
+	EVP_PKEY* pkey;
+	unsigned int maxlen;
+	unsigned char* out;
+	sign_job_t* jobs;
+} sign_many_t;
+
+static void openssl_sign_job(void* arg, int i)
+{
+	sign_many_t* m = (sign_many_t*)arg;
+	sign_job_t* j = m->jobs+i;
+	unsigned int siglen = m->maxlen;
+	j->ret = openssl_sign_data(m->pkey, m->md, j->data, j->data_len, m->out+(size_t)i*m->maxlen, &siglen);
+	j->siglen = siglen;
+}
+
+static void openssl_verify_job(void* arg, int i)
+{
+	sign_many_t* m = (sign_many_t*)arg;
+	sign_job_t* j = m->jobs+i;
+	j->ret = openssl_verify_data(j->pkey, m->md, j->data, j->data_len, j->sig, j->siglen)==1;
+}
+
+/* string item i of table at idx, kept alive by the table */
+static const char* openssl_sign_item(lua_State* L, int idx, int i, size_t* len)
+{
+	const char* s;
+	lua_rawgeti(L, idx, i);
+	if (lua_type(L, -1)!=LUA_TSTRING)
+		luaL_error(L, "#%d item %d must be string", idx, i);
+	s = lua_tolstring(L, -1, len);
+	lua_pop(L, 1);
+	return s;
+}
+
+/*  openssl.sign_many(table msgs, evp_pkey key [,digest md|string md_alg=SHA1 [,table opts]])->table{{{1
+
+	sign every message of msgs with key, digest is looked up and buffers made only
+	once. opts.threads is number of threads that sign at the same time, default 1.
+	return array of signatures, or nil and index of the first message failed
+*/
+LUA_FUNCTION(openssl_sign_many)
+{
+	sign_many_t m;
+	int n, i, threads;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	m.pkey = CHECK_OBJECT(2, EVP_PKEY, "openssl.evp_pkey");
+	m.md = openssl_sign_opt_md(L, 3);
+	threads = openssl_opt_threads(L, 4);
+	m.maxlen = EVP_PKEY_size(m.pkey);
+	n = lua_objlen(L, 1);
+
+	m.jobs = lua_newuserdata(L, (n>0?n:1)*sizeof(sign_job_t));
+	for (i=0; i<n; i++)
+		m.jobs[i].data = openssl_sign_item(L, 1, i+1, &m.jobs[i].data_len);
+	m.out = malloc((n>0?n:1)*(size_t)m.maxlen);
+	if (m.out==NULL)
+		luaL_error(L, "out of memory");
+
+	openssl_thread_run(threads, n, openssl_sign_job, &m);
+
+	lua_createtable(L, n, 0);
+	for (i=0; i<n; i++) {
+		if (!m.jobs[i].ret) {
+			lua_pushnil(L);
+			lua_pushinteger(L, i+1);
+			break;
+		}
+		lua_pushlstring(L, (const char*)m.out+(size_t)i*m.maxlen, m.jobs[i].siglen);
+		lua_rawseti(L, -2, i+1);
 	}
-	if(!mdtype)
-		mdtype = EVP_get_digestbynid(OPENSSL_ALGO_SHA1);
+	free(m.out);
+	return i<n ? 2 : 1;
+}
+/* }}} */
 
+/*  openssl.verify_many(table msgs, table sigs, evp_pkey key|table keys [,digest md|string md_alg=SHA1 [,table opts]])->table{{{1
 
-	EVP_VerifyInit   (&md_ctx, mdtype);
-	EVP_VerifyUpdate (&md_ctx, data, data_len);
-	err = EVP_VerifyFinal (&md_ctx, (unsigned char *)signature, signature_len, pkey);
-	EVP_MD_CTX_cleanup(&md_ctx);
-	lua_pushinteger(L,err);
+	verify sigs[i] is signature of msgs[i] by key, or by keys[i] if keys is a table.
+	opts.threads as sign_many. return array of booleans
+*/
+LUA_FUNCTION(openssl_verify_many)
+{
+	sign_many_t m;
+	int n, i, threads;
+	EVP_PKEY* pkey = NULL;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_istable(L, 3))
+		pkey = CHECK_OBJECT(3, EVP_PKEY, "openssl.evp_pkey");
+	m.md = openssl_sign_opt_md(L, 4);
+	threads = openssl_opt_threads(L, 5);
+	n = lua_objlen(L, 1);
+
+	m.jobs = lua_newuserdata(L, (n>0?n:1)*sizeof(sign_job_t));
+	for (i=0; i<n; i++) {
+		sign_job_t* j = m.jobs+i;
+		j->data = openssl_sign_item(L, 1, i+1, &j->data_len);
+		j->sig = openssl_sign_item(L, 2, i+1, &j->siglen);
+		j->pkey = pkey;
+		if (pkey==NULL) {
+			lua_rawgeti(L, 3, i+1);
+			j->pkey = CHECK_OBJECT(-1, EVP_PKEY, "openssl.evp_pkey");
+			lua_pop(L, 1);
+		}
+	}
+
+	openssl_thread_run(threads, n, openssl_verify_job, &m);
 
+	lua_createtable(L, n, 0);
+	for (i=0; i<n; i++) {
+		lua_pushboolean(L, m.jobs[i].ret);
+		lua_rawseti(L, -2, i+1);
+	}
 	return 1;
 }
 /* }}} */
+/* }}} */
 
 
 /* {{{ proto sealdata,ekeys openssl_seal(string data, tables pubkeys [, cipher enc|string md_alg=RC4])
@@ -292,13 +457,10 @@ LUA_FUNCTION(openssl_seal)
 		luaL_error(L,"#2 argument to openssl_seal() must be a non-empty table");
 	}
 
-	if(top>2) {
-		if(lua_isstring(L,3))
-			cipher = EVP_get_cipherbyname(lua_tostring(L,3));
-		else if(lua_isuserdata(L,3))
-			cipher = CHECK_OBJECT(3,EVP_CIPHER,"openssl.evp_cipher");
-		else
-			luaL_error(L, "#3 argument must be nil, string, or openssl.evp_cipher object");
+	if(top>2 && !lua_isnil(L,3)) {
+		cipher = GET_CIPHER(3);
+		if(!cipher)
+			luaL_error(L, "#3 unknown cipher method");
 	}
 	if(!cipher)
 		cipher = EVP_rc4();
@@ -378,13 +540,10 @@ LUA_API LUA_FUNCTION(openssl_open)
 	int ret = 0;
 
 
-	if(top>3) {
-		if(lua_isstring(L,4))
-			cipher = EVP_get_cipherbyname(lua_tostring(L,4));
-		else if(lua_isuserdata(L,4))
-			cipher = CHECK_OBJECT(4,EVP_CIPHER,"openssl.evp_cipher");
-		else
-			luaL_error(L, "#4 argument must be nil, string, or openssl.evp_cipher object");
+	if(top>3 && !lua_isnil(L,4)) {
+		cipher = GET_CIPHER(4);
+		if(!cipher)
+			luaL_error(L, "#4 unknown cipher method");
 	}
 	if(!cipher)
 		cipher = EVP_rc4();
@@ -705,6 +864,7 @@ LUA_API int luaopen_openssl(lua_State*L)
 	ERR_load_ERR_strings();
 	ERR_load_crypto_strings();
 	ERR_load_EVP_strings();
+	openssl_thread_setup();
 
 
 	/* Determine default SSL configuration file */
@@ -726,7 +886,16 @@ LUA_API int luaopen_openssl(lua_State*L)
 	openssl_register_x509(L);
 	openssl_register_csr(L);
 	openssl_register_digest(L);
+	openssl_register_hmac(L);
+	openssl_register_buffer(L);
+	openssl_register_keypool(L);
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	openssl_register_pkey_ctx(L);
+#endif
 	openssl_register_cipher(L);
+#ifdef OPENSSL_HAVE_AEAD
+	openssl_register_container(L);
+#endif
 	openssl_register_sk_x509(L);
 	openssl_register_bio(L);
 	openssl_register_crl(L);
@@ -738,6 +907,7 @@ LUA_API int luaopen_openssl(lua_State*L)
 	openssl_register_misc(L);
 
 	luaL_register(L,"openssl",eay_functions);
+	openssl_register_kdf(L);
 	
 	return 1;
 }
@@ -11,10 +11,13 @@ $Revision:$
 #include "auxiliar.h"
 
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 #include "openssl.h"
 
 /* OpenSSL includes */
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <openssl/crypto.h>
@@ -34,6 +37,10 @@ $Revision:$
 #endif
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+#define OPENSSL_HAVE_AEAD
+#endif
+
 
 /* Common */
 #include <time.h>
@@ -115,9 +122,13 @@ LUA_FUNCTION(openssl_pkey_parse);
 
 LUA_FUNCTION(openssl_pkey_encrypt);
 LUA_FUNCTION(openssl_pkey_decrypt);
+LUA_FUNCTION(openssl_pkey_derive);
+LUA_FUNCTION(openssl_pkey_ctx_new);
 
 LUA_FUNCTION(openssl_sign);
 LUA_FUNCTION(openssl_verify);
+LUA_FUNCTION(openssl_sign_many);
+LUA_FUNCTION(openssl_verify_many);
 LUA_FUNCTION(openssl_seal);
 LUA_API LUA_FUNCTION(openssl_open);
 
@@ -144,11 +155,21 @@ LUA_FUNCTION(openssl_crl_read);
 
 LUA_FUNCTION(openssl_dh_compute_key);
 LUA_FUNCTION(openssl_random_bytes);
+LUA_FUNCTION(openssl_hex);
+LUA_FUNCTION(openssl_base64);
 LUA_FUNCTION(openssl_bio_new_mem);
 LUA_FUNCTION(openssl_bio_new_file);
+LUA_FUNCTION(openssl_bio_filter_md);
+LUA_FUNCTION(openssl_bio_filter_cipher);
+LUA_FUNCTION(openssl_bio_filter_base64);
 
 LUA_FUNCTION(openssl_get_digest);
 LUA_FUNCTION(openssl_get_cipher);
+LUA_FUNCTION(openssl_hmac_new);
+LUA_FUNCTION(openssl_buffer_new);
+LUA_FUNCTION(openssl_container_open);
+LUA_FUNCTION(openssl_container_seal);
+LUA_FUNCTION(openssl_keypool_new);
 
 LUA_FUNCTION(openssl_ts_req_new);
 LUA_FUNCTION(openssl_ts_req_d2i);
@@ -203,10 +224,81 @@ void add_index_bool(lua_State* L, int i, int b);
 void add_assoc_int(lua_State* L, const char* i, int b);
 
 time_t asn1_time_to_time_t(ASN1_UTCTIME * timestr);
+
+#define OPENSSL_FILE_MAP_SIZE	(64*1024*1024)
+#define OPENSSL_FILE_READ_SIZE	(1024*1024)
+
+typedef int (*openssl_feed_cb)(void* arg, const unsigned char* data, size_t len);
+int openssl_file_feed(const char* path, lua_Number offset, lua_Number length, openssl_feed_cb cb, void* arg);
+int openssl_feed_args(lua_State* L, int from, openssl_feed_cb cb, void* arg);
+lua_Number openssl_file_size(const char* path);
+int openssl_file_read_at(FILE* fp, lua_Number offset, unsigned char* buf, size_t len);
+lua_Number openssl_opt_number(lua_State* L, int idx, const char* key, lua_Number def);
+int openssl_opt_threads(lua_State* L, int idx);
+const char* openssl_opt_lstring(lua_State* L, int idx, const char* key, size_t* len);
+size_t openssl_args_length(lua_State* L, int from);
+
+enum lua_openssl_format {
+	OPENSSL_FORMAT_RAW,
+	OPENSSL_FORMAT_HEX,
+	OPENSSL_FORMAT_BASE64,
+	OPENSSL_FORMAT_BASE64URL
+};
+int openssl_get_format(lua_State* L, int idx);
+int openssl_get_format_engine(lua_State* L, int idx, ENGINE** e);
+void openssl_push_format(lua_State* L, const unsigned char* data, size_t len, int format);
+unsigned char* openssl_decode_format(const char* in, size_t len, int format, size_t* outl);
 int openssl_object_create(lua_State* L);
 
+typedef struct {
+	unsigned char* data;
+	size_t len;
+	size_t size;
+} openssl_buffer;
+unsigned char* openssl_buffer_reserve(lua_State* L, openssl_buffer* b, size_t more);
+openssl_buffer* openssl_tobuffer(lua_State* L, int idx);
+
+int openssl_cipher_is_aead(const EVP_CIPHER* cipher);
+
+#ifdef EVP_PKEY_EC
+int openssl_ec_curve_nid(lua_State* L, int idx);
+EC_GROUP* openssl_ec_group_new(int nid);
+#endif
+int openssl_get_padding(const char* padding);
+
+void openssl_method_push(lua_State* L, const void* method, int type);
+const void* openssl_method_get(lua_State* L, int idx, int type);
+void openssl_method_list(lua_State* L, int type, int aliases);
+#define GET_DIGEST(n)	((const EVP_MD*)openssl_method_get(L,n,OBJ_NAME_TYPE_MD_METH))
+#define GET_CIPHER(n)	((const EVP_CIPHER*)openssl_method_get(L,n,OBJ_NAME_TYPE_CIPHER_METH))
+
+/* upper bound of threads option of every parallel function */
+#define OPENSSL_MAX_THREADS	64
+
+typedef void (*openssl_job_fn)(void* arg, int index);
+void openssl_thread_setup(void);
+void openssl_thread_run(int threads, int jobs, openssl_job_fn fn, void* arg);
+
+typedef struct openssl_lock_s openssl_lock;
+openssl_lock* openssl_lock_new(void);
+void openssl_lock_free(openssl_lock* lock);
+void openssl_lock_acquire(openssl_lock* lock);
+void openssl_lock_release(openssl_lock* lock);
+void openssl_lock_wait(openssl_lock* lock);
+void openssl_lock_wake(openssl_lock* lock);
+
+typedef void (*openssl_thread_fn)(void* arg);
+void* openssl_thread_start(openssl_thread_fn fn, void* arg);
+void openssl_thread_join(void* thread);
+
 int openssl_register_digest(lua_State* L);
+int openssl_register_hmac(lua_State* L);
+int openssl_register_buffer(lua_State* L);
 int openssl_register_cipher(lua_State* L);
+int openssl_register_container(lua_State* L);
+int openssl_register_kdf(lua_State* L);
+int openssl_register_keypool(lua_State* L);
+int openssl_register_pkey_ctx(lua_State* L);
 int openssl_register_x509(lua_State* L);
 int openssl_register_sk_x509(lua_State* L);
 int openssl_register_pkey(lua_State* L);
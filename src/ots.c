@@ -99,11 +99,9 @@ LUA_FUNCTION(openssl_ts_resp_ctx_new){
 		int len = lua_objlen(L, -1);
 		for(i=1; i<=len; i++)
 		{
-			const char* p;
 			const EVP_MD *md_obj;
 			lua_rawgeti(L,-1,i);
-			p = lua_tostring(L,-1);
-			md_obj = EVP_get_digestbyname(p);
+			md_obj = GET_DIGEST(-1);
 			TS_RESP_CTX_add_md(ctx, md_obj);
 			lua_pop(L,1);
 		}
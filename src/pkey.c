@@ -16,6 +16,9 @@ static luaL_Reg pkey_funcs[] = {
 
 	{"encrypt",			openssl_pkey_encrypt},
 	{"decrypt",			openssl_pkey_decrypt},
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	{"derive",			openssl_pkey_derive},
+#endif
 
 	{"__gc",			openssl_pkey_free},
 	{"__tostring",		openssl_pkey_tostring},
@@ -138,6 +141,13 @@ static int openssl_is_private_key(EVP_PKEY* pkey)
 				return 0;
 			}
 			break;
+#endif
+#ifdef EVP_PKEY_EC
+		case EVP_PKEY_EC:
+			if (pkey->pkey.ec == NULL || EC_KEY_get0_private_key(pkey->pkey.ec) == NULL) {
+				return 0;
+			}
+			break;
 #endif
 		default:
 			return -1;
@@ -166,6 +176,82 @@ static int openssl_is_private_key(EVP_PKEY* pkey)
 	lua_pop(L,1);	} while (0)
 
 
+#ifdef EVP_PKEY_EC
+/* {{{ EC groups of named curves, made once per lua state with named curve encoding and
+   precomputed multiples of generator, keys take a copy of them */
+static LUA_FUNCTION(openssl_ec_group_free)
+{
+	EC_GROUP* group = CHECK_OBJECT(1,EC_GROUP,"openssl.ec_group");
+	EC_GROUP_free(group);
+	return 0;
+}
+
+static luaL_Reg ec_group_funcs[] = {
+	{"__gc",			openssl_ec_group_free},
+
+	{NULL,			NULL},
+};
+
+/* nid of curve given by nid, short or long name, or NIST name like P-256 */
+int openssl_ec_curve_nid(lua_State* L, int idx)
+{
+	int nid;
+	if (lua_type(L,idx)==LUA_TNUMBER)
+		nid = lua_tointeger(L,idx);
+	else {
+		const char* name = luaL_checkstring(L,idx);
+		nid = OBJ_sn2nid(name);
+		if (nid==NID_undef)
+			nid = OBJ_ln2nid(name);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		if (nid==NID_undef)
+			nid = EC_curve_nist2nid(name);
+#endif
+	}
+	if (nid==NID_undef)
+		luaL_argerror(L,idx,"unknown curve");
+	return nid;
+}
+
+/* group of named curve, encoded by name and with precomputed multiples of generator */
+EC_GROUP* openssl_ec_group_new(int nid)
+{
+	EC_GROUP* group = EC_GROUP_new_by_curve_name(nid);
+	if (group) {
+		EC_GROUP_set_asn1_flag(group, OPENSSL_EC_NAMED_CURVE);
+		EC_GROUP_set_point_conversion_form(group, POINT_CONVERSION_UNCOMPRESSED);
+		EC_GROUP_precompute_mult(group, NULL);
+	}
+	return group;
+}
+
+static const EC_GROUP* openssl_ec_group(lua_State* L, int nid)
+{
+	EC_GROUP* group = NULL;
+
+	lua_getfield(L,LUA_REGISTRYINDEX,"openssl.ec_group.cache");
+	if (lua_isnil(L,-1)) {
+		lua_pop(L,1);
+		lua_newtable(L);
+		lua_pushvalue(L,-1);
+		lua_setfield(L,LUA_REGISTRYINDEX,"openssl.ec_group.cache");
+	}
+	lua_rawgeti(L,-1,nid);
+	if (lua_isuserdata(L,-1))
+		group = *(EC_GROUP**)lua_touserdata(L,-1);
+	else {
+		group = openssl_ec_group_new(nid);
+		if (group) {
+			PUSH_OBJECT(group,"openssl.ec_group");
+			lua_rawseti(L,-3,nid);
+		}
+	}
+	lua_pop(L,2);
+	return group;
+}
+/* }}} */
+#endif
+
 /* {{{ openssl_pkey_new([table configargs])->openssl.evp_pkey
 Generates a new private key */
 LUA_FUNCTION(openssl_pkey_new)
@@ -219,10 +305,14 @@ LUA_FUNCTION(openssl_pkey_new)
 #ifdef EVP_PKEY_EC
 		else if(strcasecmp(alg,"ec")==0)
 		{
-			int bits = luaL_optint(L,2,1024);
-			EC_KEY *ec = EC_KEY_new();
-			
-			EC_KEY_set_group(ec, EC_GROUP_new_by_curve_name(NID_secp192k1));
+			int nid = lua_isnoneornil(L,2) ? NID_X9_62_prime256v1 : openssl_ec_curve_nid(L,2);
+			const EC_GROUP* group = openssl_ec_group(L,nid);
+			EC_KEY *ec;
+
+			if (group==NULL)
+				luaL_error(L,"curve %s not supported",OBJ_nid2sn(nid));
+			ec = EC_KEY_new();
+			EC_KEY_set_group(ec, group);
 			if(!EC_KEY_generate_key(ec))
 			{
 				EC_KEY_free(ec);
@@ -495,6 +585,30 @@ LUA_FUNCTION(openssl_pkey_parse)
 		case EVP_PKEY_EC:
 			ktype = OPENSSL_KEYTYPE_EC;
 
+			if (pkey->pkey.ec != NULL) {
+				const EC_KEY* ec = pkey->pkey.ec;
+				const EC_GROUP* group = EC_KEY_get0_group(ec);
+				int nid = EC_GROUP_get_curve_name(group);
+				char* str;
+
+				lua_newtable(L);
+				if (nid != NID_undef) {
+					add_assoc_int(L,"nid",nid);
+					add_assoc_string(L,"curve_name",OBJ_nid2sn(nid),1);
+				}
+				if (EC_KEY_get0_private_key(ec) != NULL) {
+					str = BN_bn2hex(EC_KEY_get0_private_key(ec));
+					add_assoc_string(L,"priv_key",str,1);
+					OPENSSL_free(str);
+				}
+				if (EC_KEY_get0_public_key(ec) != NULL) {
+					str = EC_POINT_point2hex(group,EC_KEY_get0_public_key(ec),EC_KEY_get_conv_form(ec),NULL);
+					add_assoc_string(L,"pub_key",str,1);
+					OPENSSL_free(str);
+				}
+				lua_setfield(L,-2,"ec");
+			}
+
 			lua_pushstring(L,"ec");
 			lua_setfield(L,-2,"type");
 
@@ -509,7 +623,7 @@ LUA_FUNCTION(openssl_pkey_parse)
 };
 /* }}} */
 
-static int get_padding(const char* padding) {
+int openssl_get_padding(const char* padding) {
 
 	if(padding==NULL || strcasecmp(padding,"pkcs1")==0)
 		return RSA_PKCS1_PADDING;
@@ -535,47 +649,39 @@ LUA_FUNCTION(openssl_pkey_encrypt)
 	int dlen = 0;
 	EVP_PKEY *pkey = CHECK_OBJECT(1,EVP_PKEY,"openssl.evp_pkey");
 	const char *data = luaL_checklstring(L,2,&dlen);
-	int padding = get_padding(luaL_optstring(L,3,"pkcs1"));
+	int padding = openssl_get_padding(luaL_optstring(L,3,"pkcs1"));
 	int clen = EVP_PKEY_size(pkey);
 	int private = openssl_is_private_key(pkey);
-	luaL_Buffer buf;
+	unsigned char *buf;
 	int ret = 0;
 
-	luaL_buffinit(L, &buf);
-
 	switch (pkey->type) {
 		case EVP_PKEY_RSA:
 		case EVP_PKEY_RSA2:
-			if(private){
-				if((RSA_private_encrypt(dlen, 
+			/* output is EVP_PKEY_size bytes, may be more than LUAL_BUFFERSIZE */
+			buf = malloc(clen);
+			if (buf==NULL)
+				return luaL_error(L,"out of memory");
+			if(private)
+				ret = RSA_private_encrypt(dlen, 
 					(unsigned char *)data, 
-					luaL_prepbuffer(&buf), 
+					buf, 
 					pkey->pkey.rsa, 
-					padding) == clen))
-				{
-					luaL_addsize(&buf,clen);
-					luaL_pushresult(&buf);
-					return 1;
-				};
-			}else
-			{
-				if(RSA_public_encrypt(dlen, 
+					padding) == clen;
+			else
+				ret = RSA_public_encrypt(dlen, 
 					(unsigned char *)data, 
-					luaL_prepbuffer(&buf), 
+					buf, 
 					pkey->pkey.rsa, 
-					padding) == clen)
-				{
-					luaL_addsize(&buf,clen);
-					luaL_pushresult(&buf);
-					return 1;
-				}
-			}
-			
+					padding) == clen;
+			if (ret)
+				lua_pushlstring(L,(const char*)buf,clen);
+			free(buf);
 			break;
 		default:
 			luaL_error(L,"key type not supported in this lua build!");
 	}
-	return 0;
+	return ret;
 }
 /* }}} */
 
@@ -586,42 +692,35 @@ LUA_FUNCTION(openssl_pkey_decrypt)
 	int dlen = 0;
 	EVP_PKEY *pkey = CHECK_OBJECT(1,EVP_PKEY,"openssl.evp_pkey");
 	const char *data = luaL_checklstring(L,2,&dlen);
-	int padding = get_padding(luaL_optstring(L,3,"pkcs1"));
+	int padding = openssl_get_padding(luaL_optstring(L,3,"pkcs1"));
 	int mlen = EVP_PKEY_size(pkey);
 	int private = openssl_is_private_key(pkey);
-	luaL_Buffer buf;
+	unsigned char *buf;
 	int ret = 0;
-	luaL_buffinit(L, &buf);
 
 	switch (pkey->type) {
 		case EVP_PKEY_RSA:
 		case EVP_PKEY_RSA2:
+			buf = malloc(mlen);
+			if (buf==NULL)
+				return luaL_error(L,"out of memory");
 			if(private)
-			{
 				ret = RSA_private_decrypt(dlen, 
 					(unsigned char *)data, 
-					luaL_prepbuffer(&buf), 
+					buf, 
 					pkey->pkey.rsa, 
 					padding);
-				if (ret != -1) {
-					luaL_addsize(&buf,ret);
-					luaL_pushresult(&buf);
-					return 1;
-				}
-			}else
-			{
+			else
 				ret = RSA_public_decrypt(dlen, 
 					(unsigned char *)data, 
-					luaL_prepbuffer(&buf), 
+					buf, 
 					pkey->pkey.rsa, 
 					padding);
-				if (ret != -1) {
-					luaL_addsize(&buf,ret);
-					luaL_pushresult(&buf);
-					return 1;
-				}
-			}
-			break;
+			if (ret != -1)
+				lua_pushlstring(L,(const char*)buf,ret);
+			OPENSSL_cleanse(buf,mlen);
+			free(buf);
+			return ret != -1;
 		default:
 			luaL_error(L,"key type not supported in this Lua build!");
 	}
@@ -631,6 +730,38 @@ LUA_FUNCTION(openssl_pkey_decrypt)
 /* }}} */
 
 
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+/* {{{ evp_pkey:derive(evp_pkey peer) => string
+   Shared secret of private key and public key of peer, EC or DH */
+LUA_FUNCTION(openssl_pkey_derive)
+{
+	EVP_PKEY *pkey = CHECK_OBJECT(1,EVP_PKEY,"openssl.evp_pkey");
+	EVP_PKEY *peer = CHECK_OBJECT(2,EVP_PKEY,"openssl.evp_pkey");
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	unsigned char *secret;
+	size_t len = 0;
+	int ret = 0;
+
+	if (ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0
+		&& EVP_PKEY_derive(ctx, NULL, &len) > 0) {
+		secret = malloc(len);
+		if (secret==NULL) {
+			EVP_PKEY_CTX_free(ctx);
+			return luaL_error(L,"out of memory");
+		}
+		if (EVP_PKEY_derive(ctx, secret, &len) > 0) {
+			lua_pushlstring(L, (const char*)secret, len);
+			ret = 1;
+		}
+		OPENSSL_cleanse(secret, len);
+		free(secret);
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return ret;
+}
+/* }}} */
+#endif
+
 LUA_FUNCTION(openssl_pkey_is_private)
 {
 	EVP_PKEY *pkey = CHECK_OBJECT(1,EVP_PKEY,"openssl.evp_pkey");
@@ -653,6 +784,9 @@ LUA_FUNCTION(openssl_pkey_tostring)
 
 int openssl_register_pkey(lua_State*L) {
 	auxiliar_newclass(L,"openssl.evp_pkey", pkey_funcs);
+#ifdef EVP_PKEY_EC
+	auxiliar_newclass(L,"openssl.ec_group", ec_group_funcs);
+#endif
 	return 0;
 }
 
@@ -0,0 +1,336 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* pkey_ctx module for the Lua/OpenSSL binding.
+ *
+ * An openssl.pkey_ctx wraps EVP_PKEY_CTX of a key, padding, digests, OAEP label and PSS
+ * salt length are parsed once when made and applied when the ctx starts an operation,
+ * then the ctx stays ready for more of the same operation. Outputs go to a buffer kept
+ * by the ctx, sized by EVP_PKEY_size.
+ * pkey_ctx_new()
+ * pkey_ctx:encrypt()
+ * pkey_ctx:decrypt()
+ * pkey_ctx:sign()
+ * pkey_ctx:verify()
+ * pkey_ctx:derive()
+ */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+
+typedef struct {
+	EVP_PKEY_CTX* ctx;
+	int op;
+
+	int padding;
+	const EVP_MD* md;
+	const EVP_MD* oaep_md;
+	const EVP_MD* mgf1_md;
+	unsigned char* label;
+	size_t labellen;
+	int saltlen;
+	int has_saltlen;
+
+	unsigned char* out;
+	size_t outlen;
+} pkey_ctx_t;
+
+static const EVP_MD* pkey_ctx_opt_md(lua_State* L, int idx, const char* key)
+{
+	const EVP_MD* md = NULL;
+	lua_getfield(L, idx, key);
+	if (!lua_isnil(L, -1)) {
+		md = GET_DIGEST(lua_gettop(L));
+		if (md==NULL)
+			luaL_error(L, "option %s is not a digest", key);
+	}
+	lua_pop(L, 1);
+	return md;
+}
+
+/* start operation op on the ctx and apply options, nothing to do if op already started */
+static void pkey_ctx_prepare(lua_State* L, pkey_ctx_t* c, int op)
+{
+	int ret;
+	if (c->op==op)
+		return;
+
+	c->op = 0;
+	switch (op) {
+		case EVP_PKEY_OP_ENCRYPT:
+			ret = EVP_PKEY_encrypt_init(c->ctx);
+			break;
+		case EVP_PKEY_OP_DECRYPT:
+			ret = EVP_PKEY_decrypt_init(c->ctx);
+			break;
+		case EVP_PKEY_OP_SIGN:
+			ret = EVP_PKEY_sign_init(c->ctx);
+			break;
+		case EVP_PKEY_OP_VERIFY:
+			ret = EVP_PKEY_verify_init(c->ctx);
+			break;
+		default:
+			ret = EVP_PKEY_derive_init(c->ctx);
+			break;
+	}
+	if (ret<=0)
+		luaL_error(L, "operation not supported by key");
+
+	if (c->padding && EVP_PKEY_CTX_set_rsa_padding(c->ctx, c->padding)<=0)
+		luaL_error(L, "padding not supported by key or operation");
+	if (c->md && (op==EVP_PKEY_OP_SIGN || op==EVP_PKEY_OP_VERIFY)
+		&& EVP_PKEY_CTX_set_signature_md(c->ctx, c->md)<=0)
+		luaL_error(L, "md not supported by key");
+	if (c->has_saltlen && EVP_PKEY_CTX_set_rsa_pss_saltlen(c->ctx, c->saltlen)<=0)
+		luaL_error(L, "saltlen need pss padding");
+	if (c->mgf1_md && EVP_PKEY_CTX_set_rsa_mgf1_md(c->ctx, c->mgf1_md)<=0)
+		luaL_error(L, "mgf1_md need pss or oaep padding");
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	if (c->oaep_md && EVP_PKEY_CTX_set_rsa_oaep_md(c->ctx, c->oaep_md)<=0)
+		luaL_error(L, "oaep_md need oaep padding");
+	if (c->label) {
+		/* the ctx takes the label and frees it at next init */
+		unsigned char* label = OPENSSL_malloc(c->labellen>0 ? c->labellen : 1);
+		if (label==NULL)
+			luaL_error(L, "out of memory");
+		memcpy(label, c->label, c->labellen);
+		if (EVP_PKEY_CTX_set0_rsa_oaep_label(c->ctx, label, (int)c->labellen)<=0) {
+			OPENSSL_free(label);
+			luaL_error(L, "label need oaep padding");
+		}
+	}
+#endif
+	c->op = op;
+}
+
+/*  openssl.pkey_ctx_new(evp_pkey key [,table opts]) => pkey_ctx{{{1
+
+	make a ctx of key to encrypt, decrypt, sign, verify or derive many times with
+	the same options, need openssl 1.0.0. opts can have
+	  padding: pkcs1, sslv23, no, oaep, x931 or pss
+	  md: evp_digest or name of digest the input of sign and verify is made by
+	  oaep_md, mgf1_md: digests of oaep and mgf1, oaep_md need openssl 1.0.2
+	  label: oaep label, need openssl 1.0.2
+	  saltlen: pss salt length, -1 means size of md, -2 means maximum
+*/
+LUA_FUNCTION(openssl_pkey_ctx_new)
+{
+	EVP_PKEY* pkey = CHECK_OBJECT(1, EVP_PKEY, "openssl.evp_pkey");
+	pkey_ctx_t* c;
+	EVP_PKEY_CTX* ctx;
+	int padding = 0, has_saltlen = 0, saltlen = 0;
+	const EVP_MD *md = NULL, *oaep_md = NULL, *mgf1_md = NULL;
+	const char* label = NULL;
+	size_t labellen = 0;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "padding");
+		if (!lua_isnil(L, -1)) {
+			padding = openssl_get_padding(luaL_checkstring(L, -1));
+			if (padding==0)
+				luaL_error(L, "padding %s not supported", lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+		md = pkey_ctx_opt_md(L, 2, "md");
+		oaep_md = pkey_ctx_opt_md(L, 2, "oaep_md");
+		mgf1_md = pkey_ctx_opt_md(L, 2, "mgf1_md");
+		lua_getfield(L, 2, "label");
+		if (!lua_isnil(L, -1))
+			label = luaL_checklstring(L, -1, &labellen);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "saltlen");
+		if (!lua_isnil(L, -1)) {
+			has_saltlen = 1;
+			saltlen = luaL_checkint(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+	if (oaep_md || label)
+		luaL_error(L, "oaep_md and label need openssl 1.0.2");
+#endif
+
+	ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (ctx==NULL)
+		return 0;
+
+	c = malloc(sizeof(pkey_ctx_t));
+	if (c==NULL) {
+		EVP_PKEY_CTX_free(ctx);
+		return luaL_error(L, "out of memory");
+	}
+	memset(c, 0, sizeof(pkey_ctx_t));
+	c->ctx = ctx;
+	c->padding = padding;
+	c->md = md;
+	c->oaep_md = oaep_md;
+	c->mgf1_md = mgf1_md;
+	c->saltlen = saltlen;
+	c->has_saltlen = has_saltlen;
+	c->outlen = EVP_PKEY_size(pkey);
+	/* pushed first, so __gc frees what is allocated if one fails */
+	PUSH_OBJECT(c, "openssl.pkey_ctx");
+	c->out = malloc(c->outlen>0 ? c->outlen : 1);
+	if (c->out==NULL)
+		return luaL_error(L, "out of memory");
+	if (label) {
+		c->label = malloc(labellen>0 ? labellen : 1);
+		if (c->label==NULL)
+			return luaL_error(L, "out of memory");
+		memcpy(c->label, label, labellen);
+		c->labellen = labellen;
+	}
+	return 1;
+}
+/* }}} */
+
+/*  pkey_ctx:encrypt(string data)->string{{{1
+
+	encrypt data with public key, return nil if failed
+*/
+LUA_FUNCTION(openssl_pkey_ctx_encrypt)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	size_t len;
+	const char* data = luaL_checklstring(L, 2, &len);
+	size_t outlen = c->outlen;
+
+	pkey_ctx_prepare(L, c, EVP_PKEY_OP_ENCRYPT);
+	if (EVP_PKEY_encrypt(c->ctx, c->out, &outlen, (const unsigned char*)data, len)<=0)
+		return 0;
+	lua_pushlstring(L, (const char*)c->out, outlen);
+	return 1;
+}
+/* }}} */
+
+/*  pkey_ctx:decrypt(string data)->string{{{1
+
+	decrypt data with private key, return nil if failed
+*/
+LUA_FUNCTION(openssl_pkey_ctx_decrypt)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	size_t len;
+	const char* data = luaL_checklstring(L, 2, &len);
+	size_t outlen = c->outlen;
+	int ret;
+
+	pkey_ctx_prepare(L, c, EVP_PKEY_OP_DECRYPT);
+	ret = EVP_PKEY_decrypt(c->ctx, c->out, &outlen, (const unsigned char*)data, len)>0;
+	if (ret)
+		lua_pushlstring(L, (const char*)c->out, outlen);
+	OPENSSL_cleanse(c->out, c->outlen);
+	return ret;
+}
+/* }}} */
+
+/*  pkey_ctx:sign(string hash)->string{{{1
+
+	sign hash made by opts.md with private key, return nil if failed
+*/
+LUA_FUNCTION(openssl_pkey_ctx_sign)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	size_t len;
+	const char* data = luaL_checklstring(L, 2, &len);
+	size_t outlen = c->outlen;
+
+	pkey_ctx_prepare(L, c, EVP_PKEY_OP_SIGN);
+	if (EVP_PKEY_sign(c->ctx, c->out, &outlen, (const unsigned char*)data, len)<=0)
+		return 0;
+	lua_pushlstring(L, (const char*)c->out, outlen);
+	return 1;
+}
+/* }}} */
+
+/*  pkey_ctx:verify(string hash, string signature)->boolean{{{1
+
+	verify signature of hash made by opts.md with public key
+*/
+LUA_FUNCTION(openssl_pkey_ctx_verify)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	size_t len, siglen;
+	const char* data = luaL_checklstring(L, 2, &len);
+	const char* sig = luaL_checklstring(L, 3, &siglen);
+
+	pkey_ctx_prepare(L, c, EVP_PKEY_OP_VERIFY);
+	lua_pushboolean(L, EVP_PKEY_verify(c->ctx, (const unsigned char*)sig, siglen,
+		(const unsigned char*)data, len)==1);
+	return 1;
+}
+/* }}} */
+
+/*  pkey_ctx:derive(evp_pkey peer)->string{{{1
+
+	shared secret of private key and public key of peer, return nil if failed
+*/
+LUA_FUNCTION(openssl_pkey_ctx_derive)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	EVP_PKEY* peer = CHECK_OBJECT(2, EVP_PKEY, "openssl.evp_pkey");
+	size_t len = 0;
+	int ret;
+
+	pkey_ctx_prepare(L, c, EVP_PKEY_OP_DERIVE);
+	if (EVP_PKEY_derive_set_peer(c->ctx, peer)<=0 || EVP_PKEY_derive(c->ctx, NULL, &len)<=0)
+		return 0;
+	if (len>c->outlen) {
+		unsigned char* out = malloc(len);
+		if (out==NULL)
+			return luaL_error(L, "out of memory");
+		free(c->out);
+		c->out = out;
+		c->outlen = len;
+	}
+	ret = EVP_PKEY_derive(c->ctx, c->out, &len)>0;
+	if (ret)
+		lua_pushlstring(L, (const char*)c->out, len);
+	OPENSSL_cleanse(c->out, c->outlen);
+	return ret;
+}
+/* }}} */
+
+LUA_FUNCTION(openssl_pkey_ctx_free)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	EVP_PKEY_CTX_free(c->ctx);
+	if (c->label) {
+		OPENSSL_cleanse(c->label, c->labellen);
+		free(c->label);
+	}
+	free(c->out);
+	free(c);
+	return 0;
+}
+
+LUA_FUNCTION(openssl_pkey_ctx_tostring)
+{
+	pkey_ctx_t* c = CHECK_OBJECT(1, pkey_ctx_t, "openssl.pkey_ctx");
+	lua_pushfstring(L, "openssl.pkey_ctx:%p", c);
+	return 1;
+}
+
+static luaL_Reg pkey_ctx_funs[] = {
+	{"encrypt",		openssl_pkey_ctx_encrypt},
+	{"decrypt",		openssl_pkey_ctx_decrypt},
+	{"sign",		openssl_pkey_ctx_sign},
+	{"verify",		openssl_pkey_ctx_verify},
+	{"derive",		openssl_pkey_ctx_derive},
+
+	{"__gc",		openssl_pkey_ctx_free},
+	{"__tostring",	openssl_pkey_ctx_tostring},
+	{NULL, NULL}
+};
+
+int openssl_register_pkey_ctx(lua_State* L)
+{
+	auxiliar_newclass(L,"openssl.pkey_ctx",	pkey_ctx_funs);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,274 @@
+/*
+$Id:$
+$Revision:$
+*/
+
+#include "openssl.h"
+
+/* thread module for the Lua/OpenSSL binding.
+ *
+ * Small worker pool used by functions that split one call into many independent jobs,
+ * workers only run C code and never touch the lua_State.
+ * openssl_thread_setup()
+ * openssl_thread_run()
+ * openssl_lock_new()
+ * openssl_thread_start()
+ */
+
+#ifdef WIN32
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define mutex_init(m)		InitializeCriticalSection(m)
+#define mutex_lock(m)		EnterCriticalSection(m)
+#define mutex_unlock(m)		LeaveCriticalSection(m)
+#define mutex_destroy(m)	DeleteCriticalSection(m)
+#define cond_init(c)		InitializeConditionVariable(c)
+#define cond_wait(c, m)		SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c)	WakeAllConditionVariable(c)
+#define cond_destroy(c)
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define mutex_init(m)		pthread_mutex_init(m, NULL)
+#define mutex_lock(m)		pthread_mutex_lock(m)
+#define mutex_unlock(m)		pthread_mutex_unlock(m)
+#define mutex_destroy(m)	pthread_mutex_destroy(m)
+#define cond_init(c)		pthread_cond_init(c, NULL)
+#define cond_wait(c, m)		pthread_cond_wait(c, m)
+#define cond_broadcast(c)	pthread_cond_broadcast(c)
+#define cond_destroy(c)		pthread_cond_destroy(c)
+#endif
+
+/* {{{ OpenSSL locking callbacks, only needed before 1.1.0 */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static mutex_t* openssl_locks = NULL;
+
+static void openssl_locking_cb(int mode, int n, const char* file, int line)
+{
+	(void)file;
+	(void)line;
+	if (mode & CRYPTO_LOCK)
+		mutex_lock(&openssl_locks[n]);
+	else
+		mutex_unlock(&openssl_locks[n]);
+}
+
+static unsigned long openssl_thread_id_cb(void)
+{
+#ifdef WIN32
+	return (unsigned long)GetCurrentThreadId();
+#else
+	return (unsigned long)pthread_self();
+#endif
+}
+#endif
+
+/* install locking callbacks unless the application or another module did already */
+void openssl_thread_setup(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int i, n;
+	if (openssl_locks!=NULL || CRYPTO_get_locking_callback()!=NULL)
+		return;
+	n = CRYPTO_num_locks();
+	openssl_locks = OPENSSL_malloc(n * sizeof(mutex_t));
+	for (i=0; i<n; i++)
+		mutex_init(&openssl_locks[i]);
+	CRYPTO_set_id_callback(openssl_thread_id_cb);
+	CRYPTO_set_locking_callback(openssl_locking_cb);
+#endif
+}
+/* }}} */
+
+/* {{{ openssl_thread_run */
+typedef struct {
+	mutex_t lock;
+	int next;
+	int jobs;
+	openssl_job_fn fn;
+	void* arg;
+} thread_pool_t;
+
+static void thread_pool_work(thread_pool_t* pool)
+{
+	for (;;) {
+		int i;
+		mutex_lock(&pool->lock);
+		i = pool->next < pool->jobs ? pool->next++ : -1;
+		mutex_unlock(&pool->lock);
+		if (i<0)
+			break;
+		pool->fn(pool->arg, i);
+	}
+}
+
+#ifdef WIN32
+static DWORD WINAPI thread_pool_main(LPVOID p)
+{
+	thread_pool_work((thread_pool_t*)p);
+	return 0;
+}
+#else
+static void* thread_pool_main(void* p)
+{
+	thread_pool_work((thread_pool_t*)p);
+	return NULL;
+}
+#endif
+
+/* run fn(arg, i) for i in [0,jobs) on at most threads threads, the caller thread is one of
+   them, return when all jobs are done. threads is capped at OPENSSL_MAX_THREADS, fewer
+   threads are used if they can not be created, none if their handles can not be allocated */
+void openssl_thread_run(int threads, int jobs, openssl_job_fn fn, void* arg)
+{
+	thread_pool_t pool;
+	thread_t* tids;
+	int i, n = 0;
+
+	if (threads>OPENSSL_MAX_THREADS)
+		threads = OPENSSL_MAX_THREADS;
+	if (threads>jobs)
+		threads = jobs;
+	tids = threads>1 ? malloc((threads-1) * sizeof(thread_t)) : NULL;
+	if (tids==NULL) {
+		for (i=0; i<jobs; i++)
+			fn(arg, i);
+		return;
+	}
+
+	mutex_init(&pool.lock);
+	pool.next = 0;
+	pool.jobs = jobs;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	for (i=0; i<threads-1; i++) {
+#ifdef WIN32
+		tids[n] = CreateThread(NULL, 0, thread_pool_main, &pool, 0, NULL);
+		if (tids[n]==NULL)
+			break;
+#else
+		if (pthread_create(&tids[n], NULL, thread_pool_main, &pool)!=0)
+			break;
+#endif
+		n++;
+	}
+
+	thread_pool_work(&pool);
+
+	for (i=0; i<n; i++) {
+#ifdef WIN32
+		WaitForSingleObject(tids[i], INFINITE);
+		CloseHandle(tids[i]);
+#else
+		pthread_join(tids[i], NULL);
+#endif
+	}
+	free(tids);
+	mutex_destroy(&pool.lock);
+}
+/* }}} */
+
+/* {{{ lock with one condition, for state shared with long running threads */
+struct openssl_lock_s {
+	mutex_t mutex;
+	cond_t cond;
+};
+
+openssl_lock* openssl_lock_new(void)
+{
+	openssl_lock* lock = malloc(sizeof(openssl_lock));
+	mutex_init(&lock->mutex);
+	cond_init(&lock->cond);
+	return lock;
+}
+
+void openssl_lock_free(openssl_lock* lock)
+{
+	cond_destroy(&lock->cond);
+	mutex_destroy(&lock->mutex);
+	free(lock);
+}
+
+void openssl_lock_acquire(openssl_lock* lock)
+{
+	mutex_lock(&lock->mutex);
+}
+
+void openssl_lock_release(openssl_lock* lock)
+{
+	mutex_unlock(&lock->mutex);
+}
+
+/* release lock until woken, hold it again on return, caller must check its state again */
+void openssl_lock_wait(openssl_lock* lock)
+{
+	cond_wait(&lock->cond, &lock->mutex);
+}
+
+void openssl_lock_wake(openssl_lock* lock)
+{
+	cond_broadcast(&lock->cond);
+}
+/* }}} */
+
+/* {{{ openssl_thread_start */
+typedef struct {
+	openssl_thread_fn fn;
+	void* arg;
+} thread_start_t;
+
+#ifdef WIN32
+static DWORD WINAPI thread_start_main(LPVOID p)
+{
+	thread_start_t s = *(thread_start_t*)p;
+	free(p);
+	s.fn(s.arg);
+	return 0;
+}
+#else
+static void* thread_start_main(void* p)
+{
+	thread_start_t s = *(thread_start_t*)p;
+	free(p);
+	s.fn(s.arg);
+	return NULL;
+}
+#endif
+
+/* run fn(arg) on a new thread, return handle for openssl_thread_join, NULL if failed */
+void* openssl_thread_start(openssl_thread_fn fn, void* arg)
+{
+	thread_t* tid = malloc(sizeof(thread_t));
+	thread_start_t* s = malloc(sizeof(thread_start_t));
+	s->fn = fn;
+	s->arg = arg;
+#ifdef WIN32
+	*tid = CreateThread(NULL, 0, thread_start_main, s, 0, NULL);
+	if (*tid==NULL) {
+#else
+	if (pthread_create(tid, NULL, thread_start_main, s)!=0) {
+#endif
+		free(s);
+		free(tid);
+		return NULL;
+	}
+	return tid;
+}
+
+void openssl_thread_join(void* thread)
+{
+	thread_t* tid = (thread_t*)thread;
+#ifdef WIN32
+	WaitForSingleObject(*tid, INFINITE);
+	CloseHandle(*tid);
+#else
+	pthread_join(*tid, NULL);
+#endif
+	free(tid);
+}
+/* }}} */
@@ -7,3 +7,27 @@ print(openssl.random_bytes(length))
 print('ǿ', string.rep('-',40))
 print(openssl.random_bytes(length, true))
 
+assert(openssl.hex('\1\171\255')=='01abff')
+assert(openssl.hex('01ABff',false)=='\1\171\255')
+assert(openssl.hex('0g',false)==nil)
+assert(openssl.base64('abcd')=='YWJjZA==')
+assert(openssl.base64('YWJjZA==',false)=='abcd')
+assert(openssl.base64('\251\255',true,true)=='-_8')
+assert(openssl.base64('-_8',false)=='\251\255')
+
+
+local mem = openssl.bio_new_mem()
+local chain = mem:push(openssl.bio_filter_md('sha1'))
+chain:write('abcd')
+assert(chain:flush())
+assert(mem:get_mem()=='abcd')
+assert(chain:get_md_ctx():final()==openssl.get_digest('sha1'):digest('abcd'))
+
+mem = openssl.bio_new_mem()
+chain = mem:push(openssl.bio_filter_base64(false))
+chain:write('abcd')
+chain:flush()
+assert(mem:get_mem()=='YWJjZA==')
+assert(not pcall(openssl.bio_new_mem().push,openssl.bio_new_mem(),chain))
+assert(chain:pop()==mem and openssl.bio_filter_base64():pop()==nil)
+assert(openssl.bio_new_mem():push(chain)==chain)
@@ -26,4 +26,62 @@ end
 alg = {nil, 'rsa','dsa','dh'}
 for i=1,#alg do
         test_pkey(alg[i])
-end
\ No newline at end of file
+end
+for _,curve in ipairs({'prime256v1','secp384r1','secp521r1'}) do
+        pkey = openssl.pkey_new('ec',curve)
+        t = pkey:parse()
+        assert(t.type=='ec' and t.ec.curve_name==curve and pkey:is_private())
+        sig = openssl.sign('abcd',pkey,'sha256')
+        assert(openssl.verify('abcd',sig,pkey,'sha256')==1)
+        assert(openssl.verify('abce',sig,pkey,'sha256')==0)
+end
+
+rsa, ec = openssl.pkey_new('rsa'), openssl.pkey_new('ec')
+msgs = {}
+for i=1,20 do msgs[i] = 'event '..i end
+sigs = openssl.sign_many(msgs,rsa,'sha256',{threads=4})
+assert(#sigs==20 and openssl.verify(msgs[7],sigs[7],rsa,'sha256')==1)
+assert(openssl.sign_many(msgs,rsa,'sha256')[3]==sigs[3])
+sigs[20] = openssl.sign(msgs[20],ec,'sha256')
+keys = {}
+for i=1,20 do keys[i] = i<20 and rsa or ec end
+ok = openssl.verify_many(msgs,sigs,keys,'sha256',{threads=2})
+assert(ok[1] and ok[20] and #ok==20)
+ok = openssl.verify_many(msgs,sigs,rsa,'sha256')
+assert(ok[19] and not ok[20])
+assert(openssl.pkey_new('ec'):parse().ec.curve_name=='prime256v1')
+
+a, b = openssl.pkey_new('ec'), openssl.pkey_new('ec')
+if a.derive then
+        assert(#a:derive(b)==32 and a:derive(b)==b:derive(a))
+end
+
+pool = openssl.keypool_new({type='ec',target=4,threads=2})
+for i=1,8 do
+        pkey = pool:take()
+        assert(pkey:parse().ec.curve_name=='prime256v1')
+end
+t = pool:stats()
+assert(t.target==4 and t.taken+t.misses==8 and t.size<=4 and t.threads+t.failed>=2)
+pool:close()
+assert(pool:stats().threads==0 and pool:take():is_private())
+
+if openssl.pkey_ctx_new then
+        pkey = openssl.pkey_new('rsa',2048)
+        -- pkey:encrypt output is EVP_PKEY_size bytes
+        size = #pkey:encrypt('size')
+        e = openssl.pkey_ctx_new(pkey,{padding='oaep',oaep_md='sha256',label='wrap'})
+        d = openssl.pkey_ctx_new(pkey,{padding='oaep',oaep_md='sha256',label='wrap'})
+        for i=1,4 do
+                ct = e:encrypt('key'..i)
+                assert(#ct==size and d:decrypt(ct)=='key'..i)
+        end
+        assert(openssl.pkey_ctx_new(pkey,{padding='oaep',oaep_md='sha256'}):decrypt(ct)==nil)
+        assert(pkey:decrypt(pkey:encrypt('abcd'))=='abcd')
+
+        hash = openssl.get_digest('sha256'):digest('abcd')
+        s = openssl.pkey_ctx_new(pkey,{padding='pss',md='sha256',saltlen=32})
+        sig = s:sign(hash)
+        assert(s:verify(hash,sig) and not s:verify(hash:reverse(),sig))
+        assert(not pcall(openssl.pkey_ctx_new,pkey,{padding='none'}))
+end
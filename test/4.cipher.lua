@@ -14,6 +14,7 @@ function test_cipher()
         dump(t,0)
 
         c = openssl.get_cipher('des')
+        assert(c==openssl.get_cipher('des') and openssl.get_cipher(false)==openssl.get_cipher(false))
         dump(c:info(),0)
 
         m = 'abcd'
@@ -39,7 +40,167 @@ function test_cipher()
         m1= m1..c1:encrypt_final()
         assert(m1==bb)
 
+        c1=c:encrypt_init(key,iv)
+        m1 = c1:encrypt_update('a','b',{'c','d'})
+        m1= m1..c1:encrypt_final()
+        assert(m1==bb)
+        m1 = c1:reset():encrypt_update(m)
+        m1= m1..c1:encrypt_final()
+        assert(m1==bb)
+
+        c1=c:init(true,'12345678','abcdefgh')
+        m1 = c1:update(m)..c1:final()
+        c1:reset(nil,'hgfedcba')
+        assert(c1:update(m)..c1:final()==c:encrypt(m,'12345678','hgfedcba'))
+        c1:reset('12345678','abcdefgh')
+        assert(c1:update(m)..c1:final()==m1)
+
         assert(c:decrypt(c:encrypt(m,m),m)==m)
+        assert(c:decrypt(c:encrypt(m,m,nil,'hex'),m,nil,'hex')==m)
+        assert(c:encrypt(m,m,nil,'base64')==openssl.base64(c:encrypt(m,m)))
+
+        assert(not pcall(openssl.buffer_new,-1))
+        local buf = openssl.buffer_new()
+        c1=c:init(true,'12345678','abcdefgh')
+        local n = c1:update_into(buf,m)
+        n = n + c1:final_into(buf)
+        assert(n==#buf and buf:get()==c:encrypt(m,'12345678','abcdefgh'))
+        c1=c:init(false,'12345678','abcdefgh')
+        assert(c1:update(buf)..c1:final()==m)
+        assert(buf:clear():len()==0)
+
+        local recs = {'a','bb',m,''}
+        local ivs = {'iv000001','iv000002','iv000003','iv000004'}
+        local r = c:encrypt_many(recs,'12345678',ivs)
+        for i=1,#recs do
+            assert(r[i]==c:encrypt(recs[i],'12345678',ivs[i]))
+        end
+        local s,off = c:encrypt_many(recs,'12345678',function(i) return ivs[i] end,true)
+        assert(#off==#recs+1 and s==table.concat(r))
+        assert(s:sub(off[3],off[4]-1)==r[3])
+        r = c:decrypt_many(r,'12345678',ivs)
+        for i=1,#recs do assert(r[i]==recs[i]) end
+        r = c:encrypt_many(recs,'12345678','iv00000\1')
+        assert(r[2]==c:encrypt('bb','12345678','iv00000\2'))
+
+        local plain = string.rep('file data ',20000)
+        local fin,fenc,fdec = os.tmpname(),os.tmpname(),os.tmpname()
+        local f = io.open(fin,'wb') f:write(plain) f:close()
+        local size,hash = c:encrypt_file(fin,fenc,'12345678','abcdefgh',{digest='sha1',format='hex'})
+        assert(hash==openssl.get_digest('sha1'):digest(plain,'hex'))
+        f = io.open(fenc,'rb')
+        assert(f:read('*a')==c:encrypt(plain,'12345678','abcdefgh') and size==f:seek('end'))
+        f:close()
+        size,hash = c:decrypt_file(fenc,fdec,'12345678','abcdefgh',{digest='sha1',format='hex'})
+        assert(size==#plain and hash==openssl.get_digest('sha1'):digest(plain,'hex'))
+        f = io.open(fin,'wb') f:write('1234567') f:close()
+        assert(c:decrypt_file(fin,fdec,'12345678','abcdefgh')==nil)
+        os.remove(fin) os.remove(fenc) os.remove(fdec)
+
+        c = openssl.get_cipher('aes-128-gcm')
+        if c then
+            local key,iv = '0123456789abcdef','abcdefghijkl'
+            local ct,tag = c:seal_aead(m,key,iv,'header')
+            assert(#ct==#m and #tag==16)
+            assert(c:open_aead(ct,key,iv,'header',tag)==m)
+            assert(c:open_aead(ct,key,iv,'other',tag)==nil)
+
+            c1 = c:init(true)
+            c1:set_iv_length(#iv)
+            c1:reset(key,iv)
+            c1:set_aad('header')
+            assert(c1:update(m)..c1:final()==ct)
+            assert(c1:get_tag()==tag)
+
+            assert(not pcall(c1.set_iv_length,c:init(true),17))
+
+            c1 = c:init(false)
+            c1:set_iv_length(#iv)
+            c1:reset(key,iv)
+            c1:set_aad('header')
+            local p = c1:update(ct)
+            c1:set_tag(tag)
+            assert(p..c1:final()==m)
+
+            local big = string.rep('0123456789abcdefghijklmnopqrstuvwxyz',3000)
+            local opts = {threads=4,chunk=1024,aad='header'}
+            local pct,ptag = c:encrypt_parallel(big,key,iv,opts)
+            ct,tag = c:seal_aead(big,key,iv,'header')
+            assert(pct==ct and ptag==tag)
+
+            local ctr = openssl.get_cipher('aes-128-ctr')
+            iv = '0123456789abcdef'
+            assert(ctr:encrypt_parallel(big,key,iv,opts)==ctr:encrypt(big,key,iv))
+
+            local whole = ctr:encrypt(big,key,iv)
+            c1 = ctr:init(false,key,iv)
+            assert(c1:seek(50000):update(whole:sub(50001,50100))==big:sub(50001,50100))
+            assert(c1:seek(7):update(whole:sub(8,20))==big:sub(8,20))
+            assert(c1:reset():update(whole:sub(1,10))==big:sub(1,10))
+
+            local fin,fout = os.tmpname(),os.tmpname()
+            local f = io.open(fin,'wb') f:write(big) f:close()
+            opts.output = fout
+            assert(ctr:encrypt_parallel(fin,key,iv,opts)==#big)
+            f = io.open(fout,'rb')
+            assert(f:read('*a')==ctr:encrypt(big,key,iv))
+            f:close()
+            local liv = string.rep('v',20)
+            assert(select(2,c:encrypt_file(fin,fout,key,liv))==select(2,c:seal_aead(big,key,liv)))
+            os.remove(fin)
+            os.remove(fout)
+
+            local xts = openssl.get_cipher('aes-128-xts')
+            if xts then
+                local xkey = '0123456789abcdefFEDCBA9876543210'
+                local disk = big:sub(1,4096*4)
+                local enc = xts:xts_sectors(disk,xkey,7,4096)
+                assert(#enc==#disk and xts:xts_sectors(enc,xkey,7,4096,false)==disk)
+                local tweak = '\9'..string.rep('\0',15)
+                assert(enc:sub(8193,12288)==xts:encrypt(disk:sub(8193,12288),xkey,tweak))
+            end
+
+            local sc = openssl.get_cipher('aes-128-cbc-hmac-sha1')
+            if sc then
+                local e = sc:init(true,key,string.rep('\0',16))
+                local d = sc:init(false,key,string.rep('\0',16))
+                assert(e:set_mac_key('mackey') and d:set_mac_key('mackey'))
+                local body = string.rep('I',16)..m
+                local rec = e:tls_record(1,23,0x0303,body)
+                assert(#rec%16==0 and d:tls_record(1,23,0x0303,rec)==m)
+                local recs = e:tls_records(2,23,0x0303,{body,body})
+                assert(d:tls_record(3,23,0x0303,recs[2])==m)
+                assert(d:tls_record(3,23,0x0303,recs[1])==nil)
+                assert(e:tls_record(5,23,0x0303,string.rep('x',70000))==nil)
+                assert(d:tls_record(5,23,0x0303,'')==nil)
+                assert(d:tls_record(6,23,0x0303,e:tls_record(6,23,0x0303,body))==m)
+                local mb,n = e:tls_multiblock(4,23,0x0303,big:sub(1,16384))
+                if mb then
+                    local len = mb:byte(4)*256+mb:byte(5)
+                    assert(n>=4 and d:tls_record(4,23,0x0303,mb:sub(6,5+len))==big:sub(1,16384/n))
+                end
+            end
+
+            local blob = c:seal_container(big,key,{chunk=1000,threads=2})
+            local ct = openssl.container_open(blob,key,{threads=2})
+            assert(ct:size()==#big and ct:read()==big)
+            assert(ct:read(4000,5000)==big:sub(4001,9000))
+            assert(ct:read(#big-1,100)==big:sub(-1))
+            local bad = blob:sub(1,2000)..string.char((blob:byte(2001)+1)%256)..blob:sub(2002)
+            assert(openssl.container_open(bad,key):read(1000,10)==nil)
+            assert(not pcall(openssl.container_open,blob:sub(1,-2),key))
+
+            fin,fout = os.tmpname(),os.tmpname()
+            f = io.open(fin,'wb') f:write(big) f:close()
+            assert(c:seal_container(fin,key,{output=fout,chunk=1000,nonce='0123456789ab'})
+                ==#c:seal_container(big,key,{chunk=1000,nonce='0123456789ab'}))
+            ct = openssl.container_open(fout,key,{file=true})
+            assert(ct:read(12345,6789)==big:sub(12346,12345+6789))
+            ct = nil
+            collectgarbage()
+            os.remove(fin)
+            os.remove(fout)
+        end
 
 
 end
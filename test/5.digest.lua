@@ -12,15 +12,118 @@ function test_digest()
         t = openssl.get_digest(true)
         dump(t,0)
 
+        t = openssl.get_digest()
+        local n = #t
+        assert(n>0 and n==#openssl.get_digest(true) and t[1]==openssl.get_digest(true)[1])
+        t[1] = nil
+        assert(#openssl.get_digest()==n)
+
         md = openssl.get_digest('md5')
+        assert(md==openssl.get_digest('md5') and md==openssl.get_digest(md:info().nid))
         dump(md:info(),0)
         aa = md:digest('abcd')
+        assert(md:digest('abcd','hex')==openssl.hex(aa))
+        assert(md:digest('abcd','base64')==openssl.base64(aa))
 
         mdc=md:init()
         dump(mdc:info(),0)
         mdc:update('abcd')
         bb = mdc:final()
         assert(aa==bb)
+
+        t = md:digest_many({'abcd','efgh',''})
+        assert(#t==3 and t[1]==aa and t[2]==md:digest('efgh') and t[3]==md:digest(''))
+        assert(md:digest_many({'abcd','efgh',''},true)==t[1]..t[2]..t[3])
+
+        savefile('digest.tmp','abcdefgh')
+        assert(md:digest_file('digest.tmp')==md:digest('abcdefgh'))
+        assert(md:digest_file('digest.tmp',4)==t[2])
+        assert(md:digest_file('digest.tmp',0,4)==aa)
+        mdc=md:init()
+        mdc:update('abcd')
+        assert(mdc:update_file('digest.tmp',4,4))
+        assert(mdc:final()==md:digest('abcdefgh'))
+        os.remove('digest.tmp')
+
+        mdc=md:init()
+        mdc:update('ab')
+        local mdc2 = mdc:clone()
+        mdc:update('cd')
+        assert(mdc:final()==aa)
+        mdc2:update('cd')
+        assert(mdc2:final()==aa)
+
+        mdc=md:init()
+        mdc:update('ab')
+        mdc2 = md:import_state(mdc:export_state())
+        mdc2:update('cd')
+        assert(mdc2:final()==aa)
+        local st = mdc:export_state()
+        assert(not pcall(md.import_state,md,st..'x'))
+        assert(not pcall(md.import_state,md,st:sub(1,-2)))
+        local sha1 = openssl.get_digest('sha1')
+        assert(not pcall(sha1.import_state,sha1,st))
+
+        local data = string.rep('0123456789',1000)
+        local root, leaves = md:tree_digest(data,{leaf_size=1000})
+        assert(#leaves==10 and leaves[1]==md:digest('\0'..data:sub(1,1000)))
+        assert(md:tree_digest(data,{leaf_size=1000,threads=4})==root)
+        assert(md:tree_root(leaves)==root)
+        savefile('digest.tmp',data)
+        assert(md:tree_digest_file('digest.tmp',{leaf_size=1000,threads=3})==root)
+        os.remove('digest.tmp')
+
+        mdc=md:init()
+        mdc:update('a','b',{'c','d'})
+        assert(mdc:final()==aa)
+        mdc=md:init()
+        mdc:update(1,{-1})
+        assert(mdc:final()==md:digest('\1\0\0\0\0\0\0\0\1\1\255\255\255\255\255\255\255\255'))
+        mdc=md:init()
+        mdc:update(0.5)
+        assert(mdc:final()==md:digest('\2\63\224\0\0\0\0\0\0'))
+end
+
+function test_hmac()
+        local function hex(s)
+                return (s:gsub('.',function(c) return string.format('%02x',c:byte()) end))
+        end
+        local msg = 'what do ya want for nothing?'
+        local h = openssl.hmac_new('md5','Jefe')
+        dump(h:info(),0)
+        local m = h:mac(msg)
+        assert(hex(m)=='750c783e6ab0b503eaa86e310a5db738')
+        assert(h:mac(msg)==m)
+
+        local t = h:mac_many({msg,'abcd'})
+        assert(t[1]==m and t[2]==h:mac('abcd'))
+        assert(h:mac_many({msg,'abcd'},true)==t[1]..t[2])
+
+        if h.init then
+                local hc = h:init()
+                hc:update('what do ya ')
+                hc:update('want for nothing?')
+                assert(hc:final()==m)
+                hc:update(msg)
+                assert(hc:final()==m)
+                hc:update('what ',{'do ya ','want'},' for nothing?')
+                assert(hc:final()==m)
+        end
+end
+
+function test_kdf()
+        local kdf = openssl.kdf
+        assert(kdf.pbkdf2('password','salt',1,20,'sha1')==openssl.hex('0c60c80f961f0e71f3a9b524af6012062fe037a6',false))
+        local okm = kdf.hkdf(string.rep('\11',22),openssl.hex('000102030405060708090a0b0c',false),
+            openssl.hex('f0f1f2f3f4f5f6f7f8f9',false),42,openssl.get_digest('sha256'))
+        assert(okm==openssl.hex('3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865',false))
+        local keys = kdf.pbkdf2_many({'a','bb','ccc'},'salt',{10,20,30},{md='sha256',threads=2})
+        assert(#keys==3 and keys[3]==kdf.pbkdf2('ccc','salt',30,nil,'sha256'))
+        if kdf.scrypt then
+            assert(kdf.scrypt('password','NaCl',1024,8,16,64)==openssl.hex('fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640',false))
+        end
 end
 
-test_digest()
\ No newline at end of file
+test_digest()
+test_hmac()
+test_kdf()
\ No newline at end of file
@@ -0,0 +1,39 @@
+local openssl = require('openssl')
+
+-- sign and verify throughput of RSA-2048 against ECDSA on named curves
+-- usage: lua bench_sign.lua [seconds=1]
+
+local seconds = tonumber(arg and arg[1]) or 1
+local msg = string.rep('x',256)
+
+local function rate(fn)
+        local n, t = 0, os.clock()
+        repeat
+                for i=1,16 do fn() end
+                n = n + 16
+        until os.clock()-t >= seconds
+        return n/(os.clock()-t)
+end
+
+local function bench(name, pkey)
+        local sig = openssl.sign(msg,pkey,'sha256')
+        local s = rate(function() openssl.sign(msg,pkey,'sha256') end)
+        local v = rate(function() assert(openssl.verify(msg,sig,pkey,'sha256')==1) end)
+        print(string.format('%-16s %10.1f sign/s %10.1f verify/s %6d bytes', name, s, v, #sig))
+        return s, v
+end
+
+local rs, rv = bench('rsa 2048', openssl.pkey_new('rsa',2048))
+for _,curve in ipairs({'prime256v1','secp384r1','secp521r1'}) do
+        local s, v = bench('ec '..curve, openssl.pkey_new('ec',curve))
+        print(string.format('%-16s %10.1fx       %10.1fx', '  vs rsa 2048', s/rs, v/rv))
+end
+
+-- batch signing, opts.threads spreads the private key operations over threads
+local rsa = openssl.pkey_new('rsa',2048)
+local msgs = {}
+for i=1,64 do msgs[i] = msg..i end
+for _,threads in ipairs({1,2,4,8}) do
+        local s = rate(function() openssl.sign_many(msgs,rsa,'sha256',{threads=threads}) end)*#msgs
+        print(string.format('%-16s %10.1f sign/s %10.1fx', 'sign_many '..threads, s, s/rs))
+end